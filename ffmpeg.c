@@ -154,10 +154,18 @@ static int copy_tb = -1;
 static int opt_shortest = 0;
 static char *vstats_filename;
 static FILE *vstats_file;
+static char *stage_stats_filename;
+static FILE *stage_stats_file;
+#if HAVE_PTHREADS
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 static int audio_volume = 256;
 
 static int exit_on_error = 0;
+static int chunk_threads = 0;
+static int chunk_frames = 250;
+static int pipeline_frames = 0;
 static int using_stdin = 0;
 static int run_as_daemon  = 0;
 static volatile int received_nb_signals = 0;
@@ -181,10 +189,23 @@ static uint8_t *subtitle_out;
 #if HAVE_PTHREADS
 /* signal to input threads that they should exit; set by the main thread */
 static int transcoding_finished;
+
+/* the main thread waits on input_event_cond for input_event_seq to change,
+ * which input threads increment whenever they queue a packet into an empty
+ * queue or finish */
+static pthread_mutex_t input_event_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  input_event_cond = PTHREAD_COND_INITIALIZER;
+static unsigned        input_event_seq;
 #endif
 
 #define DEFAULT_PASS_LOGFILENAME_PREFIX "ffmpeg2pass"
 
+/* time spent in a stage of the transcoding pipeline, for -stage_stats_file */
+typedef struct ProfileCounter {
+    int64_t time;       /* wall clock time, in microseconds */
+    int64_t count;      /* packets or frames that went through the stage */
+} ProfileCounter;
+
 typedef struct InputFilter {
     AVFilterContext    *filter;
     struct InputStream *ist;
@@ -212,6 +233,8 @@ typedef struct FilterGraph {
     int          nb_inputs;
     OutputFilter **outputs;
     int         nb_outputs;
+
+    ProfileCounter prof_filter;
 } FilterGraph;
 
 typedef struct InputStream {
@@ -252,6 +275,13 @@ typedef struct InputStream {
     FrameBuffer *buffer_pool;
     int dr1;
 
+    struct PipelineStage *decode_stage; /* video decoder thread, with -pipeline_frames */
+    AVCodecContext *stage_template;     /* decoder settings before opening, for decode_stage */
+    AVDictionary *stage_opts;           /* decoder options before opening, for decode_stage */
+    int64_t frame_duration;  /* duration of the packet the last frame of decode_stage came from */
+    int heap_index;          /* position of this stream in the stream_heap of its file */
+    ProfileCounter prof_decode;
+
     /* decoded data from this stream goes into all those filters
      * currently video and audio only */
     InputFilter **filters;
@@ -267,13 +297,35 @@ typedef struct InputFile {
                              from ctx.nb_streams if new streams appear during av_read_frame() */
     int rate_emu;
 
+    /* min-heap of the indexes of the non-discarded streams of this file in
+     * input_streams, ordered by their pts */
+    int *stream_heap;
+    int nb_stream_heap;
+    int heap_index;       /* position of this file in input_file_heap */
+    ProfileCounter prof_demux;
+
 #if HAVE_PTHREADS
     pthread_t thread;           /* thread reading from this file */
-    int finished;               /* the thread has exited */
+    volatile int finished;      /* the thread has exited */
     int joined;                 /* the thread has been joined */
-    pthread_mutex_t fifo_lock;  /* lock for access to fifo */
-    pthread_cond_t  fifo_cond;  /* the main thread will signal on this cond after reading from fifo */
-    AVFifoBuffer *fifo;         /* demuxed packets are stored here; freed by the main thread */
+    int queue_size;             /* maximum number of packets in the queue */
+    int queue_max_bytes;        /* maximum size of the packet data in the queue, 0 for no limit */
+
+    /* single producer, single consumer ring of demuxed packets; the counters
+     * only ever grow and are each written by a single thread, so that no
+     * lock is needed to exchange packets */
+    AVPacket *queue;                /* freed by the main thread */
+    unsigned queue_mask;            /* number of entries in queue minus one */
+    volatile unsigned queue_in;     /* packets written, by the input thread */
+    volatile unsigned queue_out;    /* packets read, by the main thread */
+    volatile unsigned bytes_in;     /* packet data written, by the input thread */
+    volatile unsigned bytes_out;    /* packet data read, by the main thread */
+    /* the input thread sleeps on queue_cond while the queue is full or the
+     * demuxer has no packet ready, the main thread only takes queue_lock
+     * when writer_waiting is set */
+    volatile int writer_waiting;
+    pthread_mutex_t queue_lock;
+    pthread_cond_t  queue_cond;
 #endif
 } InputFile;
 
@@ -308,8 +360,23 @@ typedef struct OutputStream {
     int64_t *forced_kf_pts;
     int forced_kf_count;
     int forced_kf_index;
+    int forced_kf_segment;   /* force key frames where the segment muxer splits */
+    int64_t segment_splits;  /* segment split points forced so far */
     char *forced_keyframes;
 
+    /* chunked encoding, one encoder per segment */
+    AVCodecContext *chunk_template;  /* encoder settings before opening */
+    AVDictionary *chunk_opts;        /* encoder options before opening */
+    struct EncodeChunk *chunk;       /* chunk being filled */
+    struct EncodeChunk **chunks;     /* chunks being encoded, oldest first */
+    int nb_chunks;
+
+    struct PipelineStage *encode_stage; /* encoder thread, with -pipeline_frames */
+    int stage_quality;                  /* coded_frame statistics of the last packet of encode_stage */
+    uint64_t stage_error[AV_NUM_DATA_POINTERS];
+    int64_t last_queued_dts;            /* dts of the last packet queued for the mux thread */
+    ProfileCounter prof_encode;
+
     /* audio only */
     int audio_channels_map[SWR_CH_MAX];  /* list of the channels id to pick from the source stream */
     int audio_channels_mapped;           /* number of channels in audio_channels_map */
@@ -346,12 +413,41 @@ typedef struct OutputFile {
     int64_t recording_time; /* desired length of the resulting file in microseconds */
     int64_t start_time;     /* start time in microseconds */
     uint64_t limit_filesize; /* filesize limit expressed in bytes */
+    int resuming;           /* the segment muxer resumes an interrupted run */
+    int64_t resume_pts;     /* where the interrupted run stopped, in microseconds */
+    ProfileCounter prof_mux;
+
+#if HAVE_PTHREADS
+    int mux_queue_size;         /* maximum number of packets queued for the mux thread,
+                                   0 to mux on the main thread */
+    pthread_t mux_thread;       /* thread muxing into this file */
+    int mux_thread_started;
+    pthread_mutex_t mux_lock;   /* protects the fields below */
+    pthread_cond_t  mux_cond;   /* signaled whenever mux_queue changes */
+    AVFifoBuffer *mux_queue;    /* packets waiting to be muxed */
+    int mux_exit;               /* mux the queued packets and exit */
+    int mux_error;              /* first error returned by the muxer */
+    int64_t mux_size;           /* bytes written so far */
+    int64_t *mux_stream_pts;    /* st->pts.val of every stream after the last write */
+
+    /* backpressure statistics */
+    int64_t nb_mux_packets;     /* packets queued */
+    int max_mux_queued;         /* highest number of packets in the queue */
+    int64_t nb_mux_waits;       /* times the main thread waited for room in the queue */
+    int64_t mux_wait_time;      /* total time the main thread waited, in microseconds */
+#endif
 } OutputFile;
 
 static InputStream **input_streams = NULL;
 static int        nb_input_streams = 0;
 static InputFile   **input_files   = NULL;
 static int        nb_input_files   = 0;
+/* min-heap of the input file indexes, ordered by the pts of the first stream
+ * in their stream_heap */
+static int         *input_file_heap = NULL;
+
+/* time the main thread waited for the input threads */
+static ProfileCounter input_wait_prof;
 
 static OutputStream **output_streams = NULL;
 static int         nb_output_streams = 0;
@@ -382,6 +478,11 @@ typedef struct OptionsContext {
     /* input options */
     int64_t input_ts_offset;
     int rate_emu;
+    int thread_queue_size;
+    int thread_queue_bytes;
+
+    /* output options */
+    int mux_queue_size;
 
     SpecifierOpt *ts_scale;
     int        nb_ts_scale;
@@ -452,6 +553,9 @@ typedef struct OptionsContext {
 } OptionsContext;
 
 static void do_video_stats(AVFormatContext *os, OutputStream *ost, int frame_size);
+#if HAVE_PTHREADS
+static void free_encode_chunks(void);
+#endif
 
 #define MATCH_PER_STREAM_OPT(name, type, outvar, fmtctx, st)\
 {\
@@ -500,6 +604,42 @@ static void update_benchmark(const char *fmt, ...)
     }
 }
 
+static int64_t profile_start(void)
+{
+    return stage_stats_file ? av_gettime() : 0;
+}
+
+/* account the time since start and count items to a stage, from any thread */
+static void profile_end(ProfileCounter *c, int64_t start, int count)
+{
+    int64_t t;
+
+    if (!stage_stats_file)
+        return;
+    t = av_gettime();
+#if HAVE_PTHREADS
+    pthread_mutex_lock(&profile_lock);
+#endif
+    c->time  += t - start;
+    c->count += count;
+#if HAVE_PTHREADS
+    pthread_mutex_unlock(&profile_lock);
+#endif
+}
+
+static ProfileCounter profile_read(ProfileCounter *c)
+{
+    ProfileCounter ret;
+#if HAVE_PTHREADS
+    pthread_mutex_lock(&profile_lock);
+#endif
+    ret = *c;
+#if HAVE_PTHREADS
+    pthread_mutex_unlock(&profile_lock);
+#endif
+    return ret;
+}
+
 static void reset_options(OptionsContext *o, int is_input)
 {
     const OptionDef *po = options;
@@ -544,6 +684,7 @@ static void reset_options(OptionsContext *o, int is_input)
     o->mux_max_delay  = 0.7;
     o->limit_filesize = UINT64_MAX;
     o->chapters_input_file = INT_MAX;
+    o->thread_queue_size = 8;
 
     uninit_opts();
     init_opts();
@@ -1356,6 +1497,186 @@ static int decode_interrupt_cb(void *ctx)
 
 static const AVIOInterruptCB int_cb = { decode_interrupt_cb, NULL };
 
+#if HAVE_PTHREADS
+static void *mux_thread(void *arg)
+{
+    OutputFile *of = arg;
+    AVFormatContext *s = of->ctx;
+    AVPacket pkt;
+    int64_t start;
+    int i, error, ret;
+
+    for (;;) {
+        pthread_mutex_lock(&of->mux_lock);
+        while (!av_fifo_size(of->mux_queue) && !of->mux_exit)
+            pthread_cond_wait(&of->mux_cond, &of->mux_lock);
+        if (!av_fifo_size(of->mux_queue)) {
+            pthread_mutex_unlock(&of->mux_lock);
+            break;
+        }
+        av_fifo_generic_read(of->mux_queue, &pkt, sizeof(pkt), NULL);
+        error = of->mux_error;
+        pthread_cond_signal(&of->mux_cond);
+        pthread_mutex_unlock(&of->mux_lock);
+
+        /* after an error, only drain the queue */
+        start = profile_start();
+        ret = error ? 0 : av_interleaved_write_frame(s, &pkt);
+        profile_end(&of->prof_mux, start, 1);
+        av_free_packet(&pkt);
+
+        pthread_mutex_lock(&of->mux_lock);
+        if (ret < 0 && !of->mux_error)
+            of->mux_error = ret;
+        if (s->pb)
+            of->mux_size = avio_tell(s->pb);
+        for (i = 0; i < s->nb_streams; i++)
+            of->mux_stream_pts[i] = s->streams[i]->pts.val;
+        pthread_mutex_unlock(&of->mux_lock);
+    }
+    return NULL;
+}
+
+static int init_mux_threads(void)
+{
+    int i, j, ret;
+
+    for (i = 0; i < nb_output_files; i++) {
+        OutputFile *of = output_files[i];
+
+        if (of->mux_queue_size <= 0)
+            continue;
+        /* raw pictures point to frames that only live until the packet is written */
+        if (of->ctx->oformat->flags & AVFMT_RAWPICTURE) {
+            av_log(NULL, AV_LOG_WARNING, "Output file #%d cannot be muxed on a separate "
+                   "thread, ignoring -mux_queue_size\n", i);
+            continue;
+        }
+        if (!(of->mux_queue = av_fifo_alloc(of->mux_queue_size * sizeof(AVPacket))) ||
+            !(of->mux_stream_pts = av_malloc(of->ctx->nb_streams * sizeof(*of->mux_stream_pts))))
+            return AVERROR(ENOMEM);
+        for (j = 0; j < of->ctx->nb_streams; j++)
+            of->mux_stream_pts[j] = of->ctx->streams[j]->pts.val;
+        pthread_mutex_init(&of->mux_lock, NULL);
+        pthread_cond_init (&of->mux_cond, NULL);
+
+        if ((ret = pthread_create(&of->mux_thread, NULL, mux_thread, of)))
+            return AVERROR(ret);
+        of->mux_thread_started = 1;
+    }
+    return 0;
+}
+
+/* queue a packet for the mux thread of of, waiting for room in the queue */
+static void queue_mux_packet(OutputFile *of, AVPacket *pkt)
+{
+    AVPacket queued = *pkt;
+    int queued_size, ret;
+
+    /* take ownership of the data like av_interleaved_write_frame() does */
+    pkt->destruct = NULL;
+    if (av_dup_packet(&queued) < 0) {
+        av_log(NULL, AV_LOG_FATAL, "Could not queue packet for muxing\n");
+        exit_program(1);
+    }
+
+    pthread_mutex_lock(&of->mux_lock);
+    if (av_fifo_space(of->mux_queue) < sizeof(queued) && !of->mux_error) {
+        int64_t start = av_gettime();
+
+        of->nb_mux_waits++;
+        while (av_fifo_space(of->mux_queue) < sizeof(queued) && !of->mux_error)
+            pthread_cond_wait(&of->mux_cond, &of->mux_lock);
+        of->mux_wait_time += av_gettime() - start;
+    }
+    if ((ret = of->mux_error) >= 0) {
+        av_fifo_generic_write(of->mux_queue, &queued, sizeof(queued), NULL);
+        queued_size = av_fifo_size(of->mux_queue) / sizeof(queued);
+        of->max_mux_queued = FFMAX(of->max_mux_queued, queued_size);
+        of->nb_mux_packets++;
+        pthread_cond_signal(&of->mux_cond);
+    }
+    pthread_mutex_unlock(&of->mux_lock);
+
+    if (ret < 0) {
+        av_free_packet(&queued);
+        print_error("av_interleaved_write_frame()", ret);
+        exit_program(1);
+    }
+}
+
+/**
+ * Stop the mux threads.
+ * @param discard drop the queued packets instead of muxing them, used when
+ *                exiting on an error
+ */
+static int free_mux_threads(int discard)
+{
+    int i, ret = 0;
+
+    for (i = 0; i < nb_output_files; i++) {
+        OutputFile *of = output_files[i];
+        AVPacket pkt;
+
+        if (!of->mux_queue)
+            continue;
+
+        if (of->mux_thread_started) {
+            pthread_mutex_lock(&of->mux_lock);
+            of->mux_exit = 1;
+            if (discard && !of->mux_error)
+                of->mux_error = AVERROR_EXIT;
+            pthread_cond_signal(&of->mux_cond);
+            pthread_mutex_unlock(&of->mux_lock);
+            pthread_join(of->mux_thread, NULL);
+        }
+        if (!discard) {
+            if (of->mux_error < 0) {
+                print_error("av_interleaved_write_frame()", of->mux_error);
+                ret = of->mux_error;
+            }
+            av_log(NULL, AV_LOG_INFO, "Output #%d: %"PRId64" packets muxed through a queue of %d, "
+                   "at most %d queued, waited %"PRId64" times for %0.3fs\n",
+                   i, of->nb_mux_packets, of->mux_queue_size, of->max_mux_queued,
+                   of->nb_mux_waits, of->mux_wait_time / 1000000.0);
+        }
+
+        while (av_fifo_size(of->mux_queue)) {
+            av_fifo_generic_read(of->mux_queue, &pkt, sizeof(pkt), NULL);
+            av_free_packet(&pkt);
+        }
+        av_fifo_free(of->mux_queue);
+        of->mux_queue = NULL;
+        av_freep(&of->mux_stream_pts);
+        pthread_mutex_destroy(&of->mux_lock);
+        pthread_cond_destroy(&of->mux_cond);
+    }
+    return ret;
+}
+
+/* bytes written to an output file muxed on its own thread */
+static int64_t mux_thread_size(OutputFile *of)
+{
+    int64_t size;
+
+    pthread_mutex_lock(&of->mux_lock);
+    size = of->mux_size;
+    pthread_mutex_unlock(&of->mux_lock);
+    return size;
+}
+
+/* st->pts.val of a stream of an output file muxed on its own thread */
+static int64_t mux_thread_stream_pts(OutputFile *of, int index)
+{
+    int64_t pts;
+
+    pthread_mutex_lock(&of->mux_lock);
+    pts = of->mux_stream_pts[index];
+    pthread_mutex_unlock(&of->mux_lock);
+    return pts;
+}
+#endif
+
 void av_noreturn exit_program(int ret)
 {
     int i, j;
@@ -1378,11 +1699,20 @@ void av_noreturn exit_program(int ret)
 
     av_freep(&subtitle_out);
 
+#if HAVE_PTHREADS
+    free_encode_chunks();
+    free_mux_threads(1);
+#endif
+
     /* close files */
     for (i = 0; i < nb_output_files; i++) {
         AVFormatContext *s = output_files[i]->ctx;
-        if (!(s->oformat->flags & AVFMT_NOFILE) && s->pb)
-            avio_close(s->pb);
+        if (!(s->oformat->flags & AVFMT_NOFILE) && s->pb &&
+            avio_close(s->pb) < 0 && !ret) {
+            /* write errors of write-behind outputs can show up this late */
+            av_log(NULL, AV_LOG_ERROR, "Error closing output file %s\n", s->filename);
+            ret = 1;
+        }
         avformat_free_context(s);
         av_dict_free(&output_files[i]->opts);
         av_freep(&output_files[i]);
@@ -1403,6 +1733,7 @@ void av_noreturn exit_program(int ret)
     }
     for (i = 0; i < nb_input_files; i++) {
         avformat_close_input(&input_files[i]->ctx);
+        av_freep(&input_files[i]->stream_heap);
         av_freep(&input_files[i]);
     }
     for (i = 0; i < nb_input_streams; i++) {
@@ -1416,9 +1747,13 @@ void av_noreturn exit_program(int ret)
     if (vstats_file)
         fclose(vstats_file);
     av_free(vstats_filename);
+    if (stage_stats_file)
+        fclose(stage_stats_file);
+    av_free(stage_stats_filename);
 
     av_freep(&input_streams);
     av_freep(&input_files);
+    av_freep(&input_file_heap);
     av_freep(&output_streams);
     av_freep(&output_files);
 
@@ -1488,15 +1823,26 @@ static void write_frame(AVFormatContext *s, AVPacket *pkt, OutputStream *ost)
 {
     AVBitStreamFilterContext *bsfc = ost->bitstream_filters;
     AVCodecContext          *avctx = ost->st->codec;
+    OutputFile                 *of = output_files[ost->file_index];
+    int64_t cur_dts = ost->st->cur_dts;
+    int64_t start;
     int ret;
 
+#if HAVE_PTHREADS
+    /* st->cur_dts is the dts of the last packet given to the muxer; while
+     * the mux thread runs, that is the last packet queued for it and the
+     * muxer state belongs to the mux thread */
+    if (of->mux_queue)
+        cur_dts = ost->last_queued_dts;
+#endif
+
     if ((avctx->codec_type == AVMEDIA_TYPE_VIDEO && video_sync_method == VSYNC_DROP) ||
         (avctx->codec_type == AVMEDIA_TYPE_AUDIO && audio_sync_method < 0))
         pkt->pts = pkt->dts = AV_NOPTS_VALUE;
 
     if (avctx->codec_type == AVMEDIA_TYPE_AUDIO && pkt->dts != AV_NOPTS_VALUE) {
-        int64_t max = ost->st->cur_dts + !(s->oformat->flags & AVFMT_TS_NONSTRICT);
-        if (ost->st->cur_dts && ost->st->cur_dts != AV_NOPTS_VALUE &&  max > pkt->dts) {
+        int64_t max = cur_dts + !(s->oformat->flags & AVFMT_TS_NONSTRICT);
+        if (cur_dts && cur_dts != AV_NOPTS_VALUE &&  max > pkt->dts) {
             av_log(s, max - pkt->dts > 2 ? AV_LOG_WARNING : AV_LOG_DEBUG, "Audio timestamp %"PRId64" < %"PRId64" invalid, cliping\n", pkt->dts, max);
             pkt->pts = pkt->dts = max;
         }
@@ -1540,7 +1886,17 @@ static void write_frame(AVFormatContext *s, AVPacket *pkt, OutputStream *ost)
     }
 
     pkt->stream_index = ost->index;
+#if HAVE_PTHREADS
+    if (of->mux_queue) {
+        if (pkt->dts != AV_NOPTS_VALUE)
+            ost->last_queued_dts = pkt->dts;
+        queue_mux_packet(of, pkt);
+        return;
+    }
+#endif
+    start = profile_start();
     ret = av_interleaved_write_frame(s, pkt);
+    profile_end(&of->prof_mux, start, 1);
     if (ret < 0) {
         print_error("av_interleaved_write_frame()", ret);
         exit_program(1);
@@ -1560,11 +1916,636 @@ static int check_recording_time(OutputStream *ost)
     return 1;
 }
 
+/* duration of a video packet in AV_TIME_BASE units, from the packet itself
+ * or else from the frame rate of the decoder; repeat_pict is the one the
+ * parser found for the packet, -1 without parser */
+static int64_t video_packet_duration(InputStream *ist, AVCodecContext *dec,
+                                     const AVPacket *pkt, int repeat_pict)
+{
+    if (pkt->duration)
+        return av_rescale_q(pkt->duration, ist->st->time_base, AV_TIME_BASE_Q);
+    if (dec->time_base.num != 0 && dec->time_base.den != 0) {
+        int ticks = repeat_pict >= 0 ? repeat_pict + 1 : dec->ticks_per_frame;
+        return ((int64_t)AV_TIME_BASE * dec->time_base.num * ticks) / dec->time_base.den;
+    }
+    return 0;
+}
+
+#if HAVE_PTHREADS
+/*
+ * Deep copies of frames passed between threads. The data is allocated as a
+ * single buffer kept in base[0], so that it can be freed even after the data
+ * pointers were changed, e.g. by deinterlacing.
+ */
+static AVFrame *copy_video_frame(const AVFrame *src, enum PixelFormat pix_fmt,
+                                 int width, int height)
+{
+    AVFrame *frame = av_malloc(sizeof(*frame));
+
+    if (!frame)
+        return NULL;
+    *frame = *src;
+    if (avpicture_alloc((AVPicture *)frame, pix_fmt, width, height) < 0) {
+        av_free(frame);
+        return NULL;
+    }
+    av_picture_copy((AVPicture *)frame, (const AVPicture *)src,
+                    pix_fmt, width, height);
+    frame->base[0]       = frame->data[0];
+    frame->extended_data = frame->data;
+    frame->qscale_table  = NULL;
+    frame->mbskip_table  = NULL;
+    frame->opaque        = NULL;
+    return frame;
+}
+
+static AVFrame *copy_audio_frame(const AVFrame *src, enum AVSampleFormat sample_fmt,
+                                 int channels)
+{
+    int planes = av_sample_fmt_is_planar(sample_fmt) ? channels : 1;
+    AVFrame *frame = av_malloc(sizeof(*frame));
+
+    if (!frame)
+        return NULL;
+    *frame = *src;
+    frame->extended_data = frame->data;
+    if (planes > AV_NUM_DATA_POINTERS &&
+        !(frame->extended_data = av_mallocz(planes * sizeof(*frame->extended_data))))
+        goto fail;
+    if (av_samples_alloc(frame->extended_data, &frame->linesize[0], channels,
+                         src->nb_samples, sample_fmt, 0) < 0)
+        goto fail;
+    av_samples_copy(frame->extended_data, src->extended_data, 0, 0,
+                    src->nb_samples, channels, sample_fmt);
+    if (frame->extended_data != frame->data)
+        memcpy(frame->data, frame->extended_data, sizeof(frame->data));
+    frame->base[0] = frame->extended_data[0];
+    frame->opaque  = NULL;
+    return frame;
+
+fail:
+    if (frame->extended_data != frame->data)
+        av_free(frame->extended_data);
+    av_free(frame);
+    return NULL;
+}
+
+static void free_frame_copy(AVFrame **pframe)
+{
+    AVFrame *frame = *pframe;
+
+    if (!frame)
+        return;
+    av_free(frame->base[0]);
+    if (frame->extended_data != frame->data)
+        av_free(frame->extended_data);
+    av_freep(pframe);
+}
+
+static void free_codec_context(AVCodecContext **penc)
+{
+    AVCodecContext *enc = *penc;
+
+    if (!enc)
+        return;
+    avcodec_close(enc);
+    av_freep(&enc->extradata);
+    av_freep(&enc->rc_eq);
+    av_freep(&enc->intra_matrix);
+    av_freep(&enc->inter_matrix);
+    av_freep(&enc->rc_override);
+    av_freep(penc);
+}
+
+/*
+ * A decoder or an encoder running on its own thread, with -pipeline_frames.
+ * The main thread sends it work items and receives their results in order,
+ * through queues protected by lock.
+ */
+typedef struct PipelineStage {
+    pthread_t thread;
+    int thread_started;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;        /* signaled whenever a queue changes */
+    AVFifoBuffer *items;         /* items waiting for the stage thread */
+    AVFifoBuffer *results;       /* results waiting for the main thread */
+    int item_size;
+    int result_size;
+    int nb_items;                /* items queued or being processed */
+    int error;                   /* set by the stage thread when a result was lost */
+    int exit;                    /* set by the main thread to stop the stage thread */
+
+    /* only used by the main thread */
+    int nb_pending;              /* items sent whose result was not received yet */
+    int flush_sent;              /* the flush item was sent */
+    int flushed;                 /* the result of the flush item was received */
+} PipelineStage;
+
+typedef struct DecodeItem {
+    AVPacket pkt;
+    int repeat_pict;    /* repeat_pict of the parser for the packet, -1 without parser */
+} DecodeItem;
+
+typedef struct DecodedFrame {
+    AVFrame *frame;     /* copy of the decoded frame, NULL if there is none */
+    int ret;            /* return value of the decoder */
+    int flushing;       /* the result comes from the flush item */
+    int flushed;        /* the decoder is drained, the last result of the flush item */
+    int64_t duration;   /* duration of the packet of the item, in AV_TIME_BASE units */
+
+    /* parameters of the decoder context after the item was decoded */
+    int width, height;
+    enum PixelFormat pix_fmt;
+    AVRational sample_aspect_ratio;
+    AVRational time_base;
+    int ticks_per_frame;
+    int has_b_frames;
+} DecodedFrame;
+
+typedef struct EncodedPacket {
+    AVPacket pkt;
+    int ret;            /* return value of the encoder */
+    int flushed;        /* the encoder is drained, the last result of the flush item */
+    int quality;        /* coded_frame statistics of the encoder after the packet */
+    uint64_t error[AV_NUM_DATA_POINTERS];
+} EncodedPacket;
+
+/* allocate a stage into *pst and start its thread, which may use *pst */
+static int init_pipeline_stage(PipelineStage **pst, int item_size, int result_size,
+                               void *(*func)(void *), void *arg)
+{
+    PipelineStage *st = av_mallocz(sizeof(*st));
+    int ret;
+
+    if (!st)
+        return AVERROR(ENOMEM);
+    st->item_size   = item_size;
+    st->result_size = result_size;
+    if (!(st->items   = av_fifo_alloc(pipeline_frames * item_size)) ||
+        !(st->results = av_fifo_alloc(pipeline_frames * result_size))) {
+        av_fifo_free(st->items);
+        av_free(st);
+        return AVERROR(ENOMEM);
+    }
+    pthread_mutex_init(&st->lock, NULL);
+    pthread_cond_init (&st->cond, NULL);
+    *pst = st;
+
+    if ((ret = pthread_create(&st->thread, NULL, func, arg)))
+        return AVERROR(ret);
+    st->thread_started = 1;
+    return 0;
+}
+
+/* free a stage, releasing the items and results still queued */
+static void free_pipeline_stage(PipelineStage **pst,
+                                void (*free_item)(void *), void (*free_result)(void *))
+{
+    PipelineStage *st = *pst;
+    union {
+        DecodeItem    pkt;
+        AVFrame      *frame;
+        DecodedFrame  decoded;
+        EncodedPacket encoded;
+    } buf;
+
+    if (!st)
+        return;
+
+    if (st->thread_started) {
+        pthread_mutex_lock(&st->lock);
+        st->exit = 1;
+        pthread_cond_broadcast(&st->cond);
+        pthread_mutex_unlock(&st->lock);
+        pthread_join(st->thread, NULL);
+    }
+    while (av_fifo_size(st->items)) {
+        av_fifo_generic_read(st->items, &buf, st->item_size, NULL);
+        free_item(&buf);
+    }
+    while (av_fifo_size(st->results)) {
+        av_fifo_generic_read(st->results, &buf, st->result_size, NULL);
+        free_result(&buf);
+    }
+    av_fifo_free(st->items);
+    av_fifo_free(st->results);
+    pthread_mutex_destroy(&st->lock);
+    pthread_cond_destroy(&st->cond);
+    av_freep(pst);
+}
+
+/* queue an item, waiting while pipeline_frames items are already queued */
+static void pipeline_send(PipelineStage *st, const void *item)
+{
+    pthread_mutex_lock(&st->lock);
+    while (st->nb_items >= pipeline_frames)
+        pthread_cond_wait(&st->cond, &st->lock);
+    av_fifo_generic_write(st->items, (void *)item, st->item_size, NULL);
+    st->nb_items++;
+    st->nb_pending++;
+    pthread_cond_broadcast(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+}
+
+/* get the oldest result, optionally waiting for it; return 1 if a result was
+ * read, 0 if there is none and a negative error code if one was lost */
+static int pipeline_receive(PipelineStage *st, void *result, int block)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&st->lock);
+    while (block && !av_fifo_size(st->results) && !st->error)
+        pthread_cond_wait(&st->cond, &st->lock);
+    if (st->error) {
+        ret = st->error;
+    } else if (av_fifo_size(st->results)) {
+        av_fifo_generic_read(st->results, result, st->result_size, NULL);
+        ret = 1;
+    }
+    pthread_mutex_unlock(&st->lock);
+
+    return ret;
+}
+
+/* stage thread side: wait for the next item, return 0 when asked to exit */
+static int pipeline_get_item(PipelineStage *st, void *item)
+{
+    int ret;
+
+    pthread_mutex_lock(&st->lock);
+    while (!av_fifo_size(st->items) && !st->exit)
+        pthread_cond_wait(&st->cond, &st->lock);
+    if ((ret = !st->exit))
+        av_fifo_generic_read(st->items, item, st->item_size, NULL);
+    pthread_mutex_unlock(&st->lock);
+
+    return ret;
+}
+
+/* stage thread side: queue a result; return a negative error code if it
+ * could not be queued, in which case the caller keeps ownership */
+static int pipeline_put_result(PipelineStage *st, void *result)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&st->lock);
+    if (av_fifo_space(st->results) < st->result_size &&
+        (ret = av_fifo_realloc2(st->results, 2 * av_fifo_size(st->results) + st->result_size)) < 0)
+        st->error = ret;
+    else
+        av_fifo_generic_write(st->results, result, st->result_size, NULL);
+    pthread_cond_broadcast(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+
+    return ret;
+}
+
+/* stage thread side: the current item has been processed */
+static void pipeline_item_done(PipelineStage *st)
+{
+    pthread_mutex_lock(&st->lock);
+    st->nb_items--;
+    pthread_cond_broadcast(&st->cond);
+    pthread_mutex_unlock(&st->lock);
+}
+
+static void free_packet_item(void *item)
+{
+    av_free_packet(&((DecodeItem *)item)->pkt);
+}
+
+static void free_decoded_frame(void *result)
+{
+    free_frame_copy(&((DecodedFrame *)result)->frame);
+}
+
+/*
+ * The decoder context of the stream belongs to the main thread, which keeps
+ * using its parameters. The decoder thread decodes with its own context and
+ * returns the parameters with each result, for the main thread to copy them
+ * back when it gets to the frame.
+ */
+static void *decode_stage_thread(void *arg)
+{
+    InputStream *ist = arg;
+    PipelineStage *st = ist->decode_stage;
+    AVFrame *decoded_frame = avcodec_alloc_frame();
+    AVCodecContext *dec = avcodec_alloc_context3(NULL);
+    AVDictionary *opts = NULL;
+    DecodeItem item;
+    int err;
+
+    av_dict_copy(&opts, ist->stage_opts, 0);
+    if (!decoded_frame || !dec)
+        err = AVERROR(ENOMEM);
+    else if ((err = avcodec_copy_context(dec, ist->stage_template)) >= 0)
+        err = avcodec_open2(dec, ist->dec, &opts);
+    av_dict_free(&opts);
+
+    while (pipeline_get_item(st, &item)) {
+        AVPacket *pkt = &item.pkt;
+        DecodedFrame out;
+        int got_output;
+
+        do {
+            memset(&out, 0, sizeof(out));
+            out.flushing = !pkt->size;
+            got_output   = 0;
+            if (err < 0) {
+                out.ret = err;
+            } else {
+                int64_t start = profile_start();
+                avcodec_get_frame_defaults(decoded_frame);
+                out.ret = avcodec_decode_video2(dec, decoded_frame, &got_output, pkt);
+                profile_end(&ist->prof_decode, start, !!got_output);
+
+                out.duration            = video_packet_duration(ist, dec, pkt, item.repeat_pict);
+                out.width               = dec->width;
+                out.height              = dec->height;
+                out.pix_fmt             = dec->pix_fmt;
+                out.sample_aspect_ratio = dec->sample_aspect_ratio;
+                out.time_base           = dec->time_base;
+                out.ticks_per_frame     = dec->ticks_per_frame;
+                out.has_b_frames        = dec->has_b_frames;
+            }
+            if (out.ret >= 0 && got_output &&
+                !(out.frame = copy_video_frame(decoded_frame, decoded_frame->format,
+                                               decoded_frame->width, decoded_frame->height)))
+                out.ret = AVERROR(ENOMEM);
+            /* draining ends with the first call returning no frame */
+            if (out.flushing && !out.frame)
+                break;
+            if (pipeline_put_result(st, &out) < 0)
+                free_decoded_frame(&out);
+        } while (out.flushing);
+
+        if (out.flushing) {
+            out.flushed = 1;
+            pipeline_put_result(st, &out);
+        }
+        av_free_packet(pkt);
+        pipeline_item_done(st);
+    }
+
+    free_codec_context(&dec);
+    av_free(decoded_frame);
+    return NULL;
+}
+
+/* copy the decoder parameters returned with a result to the stream context */
+static void update_decoder_params(InputStream *ist, const DecodedFrame *out)
+{
+    AVCodecContext *dec = ist->st->codec;
+
+    if (out->ret < 0)
+        return;
+    dec->width               = out->width;
+    dec->height              = out->height;
+    dec->pix_fmt             = out->pix_fmt;
+    dec->sample_aspect_ratio = out->sample_aspect_ratio;
+    dec->time_base           = out->time_base;
+    dec->ticks_per_frame     = out->ticks_per_frame;
+    dec->has_b_frames        = out->has_b_frames;
+}
+
+/*
+ * Decode a video packet on the decoder thread of ist. The frames are returned
+ * with a delay of up to pipeline_frames packets, like a frame threaded decoder
+ * does, and the frame returned in *frame must be freed with free_frame_copy().
+ * The packet travels with the timestamps and duration it has when it is sent,
+ * and ist->frame_duration is set to the duration of the packet the returned
+ * frame was decoded from.
+ */
+static int decode_video_pipelined(InputStream *ist, AVPacket *pkt, int *got_output,
+                                  AVFrame **frame)
+{
+    PipelineStage *st;
+    DecodedFrame out;
+    DecodeItem item;
+    int ret;
+
+    *got_output = 0;
+    *frame      = NULL;
+
+    if (!ist->decode_stage &&
+        (ret = init_pipeline_stage(&ist->decode_stage, sizeof(DecodeItem), sizeof(DecodedFrame),
+                                   decode_stage_thread, ist)) < 0)
+        return ret;
+    st = ist->decode_stage;
+
+    item.repeat_pict = ist->st->parser ? ist->st->parser->repeat_pict : -1;
+    if (pkt->size) {
+        item.pkt = *pkt;
+
+        /* the data belongs to the demuxer, which may reuse it */
+        item.pkt.destruct = NULL;
+        if ((ret = av_dup_packet(&item.pkt)) < 0)
+            return ret;
+        pipeline_send(st, &item);
+        if (st->nb_pending <= pipeline_frames)
+            return pkt->size;
+    } else {
+        if (st->flushed)
+            return 0;
+        if (!st->flush_sent) {
+            av_init_packet(&item.pkt);
+            item.pkt.data = NULL;
+            item.pkt.size = 0;
+            pipeline_send(st, &item);
+            st->flush_sent = 1;
+        }
+    }
+
+    while ((ret = pipeline_receive(st, &out, 1)) > 0) {
+        if (!out.flushing || out.flushed)
+            st->nb_pending--;
+        if (out.flushed) {
+            st->flushed = 1;
+            return 0;
+        }
+        update_decoder_params(ist, &out);
+        /* when draining, skip to the next frame */
+        if (!pkt->size && !out.frame)
+            continue;
+        ist->frame_duration = out.duration;
+        *frame      = out.frame;
+        *got_output = !!out.frame;
+        return out.ret < 0 ? out.ret : pkt->size;
+    }
+    return ret;
+}
+
+static void free_frame_item(void *item)
+{
+    free_frame_copy(item);
+}
+
+static void free_encoded_packet(void *result)
+{
+    av_free_packet(&((EncodedPacket *)result)->pkt);
+}
+
+static void *encode_stage_thread(void *arg)
+{
+    OutputStream *ost = arg;
+    PipelineStage *st = ost->encode_stage;
+    AVCodecContext *enc = ost->st->codec;
+    AVFrame *frame;
+
+    while (pipeline_get_item(st, &frame)) {
+        EncodedPacket out;
+        int64_t start;
+        int got_packet;
+
+        /* a NULL frame drains the encoder, only audio encoders with a
+         * frame size can have delayed packets */
+        do {
+            memset(&out, 0, sizeof(out));
+            av_init_packet(&out.pkt);
+            got_packet = 0;
+            if (!frame && enc->codec_type == AVMEDIA_TYPE_AUDIO && enc->frame_size <= 1)
+                break;
+
+            start = profile_start();
+            if (enc->codec_type == AVMEDIA_TYPE_VIDEO)
+                out.ret = avcodec_encode_video2(enc, &out.pkt, frame, &got_packet);
+            else
+                out.ret = avcodec_encode_audio2(enc, &out.pkt, frame, &got_packet);
+            profile_end(&ost->prof_encode, start, !!frame);
+            if (out.ret < 0) {
+                pipeline_put_result(st, &out);
+                break;
+            }
+
+            if (ost->logfile && enc->stats_out && (got_packet || !frame))
+                fprintf(ost->logfile, "%s", enc->stats_out);
+            if (!got_packet)
+                break;
+            if (enc->coded_frame) {
+                out.quality = enc->coded_frame->quality;
+                memcpy(out.error, enc->coded_frame->error, sizeof(out.error));
+            }
+            if (enc->codec_type == AVMEDIA_TYPE_VIDEO && frame &&
+                out.pkt.pts == AV_NOPTS_VALUE && !(enc->codec->capabilities & CODEC_CAP_DELAY))
+                out.pkt.pts = frame->pts;
+            if (av_dup_packet(&out.pkt) < 0 || pipeline_put_result(st, &out) < 0)
+                av_free_packet(&out.pkt);
+        } while (!frame);
+
+        if (!frame) {
+            memset(&out, 0, sizeof(out));
+            out.flushed = 1;
+            pipeline_put_result(st, &out);
+        }
+        free_frame_copy(&frame);
+        pipeline_item_done(st);
+    }
+
+    return NULL;
+}
+
+/* write the packets encoded by the encoder thread of ost, waiting for all of
+ * them when draining */
+static void write_encoded_packets(AVFormatContext *s, OutputStream *ost, int flush)
+{
+    AVCodecContext *enc = ost->st->codec;
+    PipelineStage *st = ost->encode_stage;
+    EncodedPacket out;
+    int ret;
+
+    while ((ret = pipeline_receive(st, &out, flush)) > 0) {
+        AVPacket *pkt = &out.pkt;
+
+        st->nb_pending -= out.flushed;
+        if (out.flushed)
+            return;
+        if (out.ret < 0) {
+            av_log(NULL, AV_LOG_FATAL, "%s encoding failed\n",
+                   enc->codec_type == AVMEDIA_TYPE_VIDEO ? "Video" : "Audio");
+            exit_program(1);
+        }
+        ost->stage_quality = out.quality;
+        memcpy(ost->stage_error, out.error, sizeof(ost->stage_error));
+
+        if (pkt->pts != AV_NOPTS_VALUE)
+            pkt->pts = av_rescale_q(pkt->pts, enc->time_base, ost->st->time_base);
+        if (pkt->dts != AV_NOPTS_VALUE)
+            pkt->dts = av_rescale_q(pkt->dts, enc->time_base, ost->st->time_base);
+        if (enc->codec_type == AVMEDIA_TYPE_AUDIO && pkt->duration > 0)
+            pkt->duration = av_rescale_q(pkt->duration, enc->time_base, ost->st->time_base);
+
+        if (debug_ts) {
+            av_log(NULL, AV_LOG_INFO, "encoder -> type:%s "
+                   "pkt_pts:%s pkt_pts_time:%s pkt_dts:%s pkt_dts_time:%s\n",
+                   enc->codec_type == AVMEDIA_TYPE_VIDEO ? "video" : "audio",
+                   av_ts2str(pkt->pts), av_ts2timestr(pkt->pts, &ost->st->time_base),
+                   av_ts2str(pkt->dts), av_ts2timestr(pkt->dts, &ost->st->time_base));
+        }
+
+        write_frame(s, pkt, ost);
+        if (enc->codec_type == AVMEDIA_TYPE_VIDEO)
+            video_size += pkt->size;
+        else
+            audio_size += pkt->size;
+        av_free_packet(pkt);
+    }
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_FATAL, "Could not queue encoded packet\n");
+        exit_program(1);
+    }
+}
+
+/* hand a frame over to the encoder thread of ost, NULL to drain the encoder */
+static void encode_frame_pipelined(AVFormatContext *s, OutputStream *ost,
+                                   const AVFrame *in)
+{
+    AVCodecContext *enc = ost->st->codec;
+    AVFrame *frame = NULL;
+
+    if (!ost->encode_stage &&
+        init_pipeline_stage(&ost->encode_stage, sizeof(AVFrame *), sizeof(EncodedPacket),
+                            encode_stage_thread, ost) < 0)
+        goto fail;
+
+    if (in) {
+        if (enc->codec_type == AVMEDIA_TYPE_VIDEO)
+            frame = copy_video_frame(in, enc->pix_fmt, enc->width, enc->height);
+        else
+            frame = copy_audio_frame(in, enc->sample_fmt, enc->channels);
+        if (!frame)
+            goto fail;
+    }
+    pipeline_send(ost->encode_stage, &frame);
+    write_encoded_packets(s, ost, !in);
+    return;
+
+fail:
+    av_log(NULL, AV_LOG_FATAL, "Could not queue frame for encoding.\n");
+    exit_program(1);
+}
+
+static void free_pipeline_stages(void)
+{
+    int i;
+
+    for (i = 0; i < nb_input_streams; i++) {
+        free_pipeline_stage(&input_streams[i]->decode_stage,
+                            free_packet_item, free_decoded_frame);
+        free_codec_context(&input_streams[i]->stage_template);
+        av_dict_free(&input_streams[i]->stage_opts);
+    }
+    for (i = 0; i < nb_output_streams; i++)
+        free_pipeline_stage(&output_streams[i]->encode_stage,
+                            free_frame_item, free_encoded_packet);
+}
+#endif
+
 static void do_audio_out(AVFormatContext *s, OutputStream *ost,
                          AVFrame *frame)
 {
     AVCodecContext *enc = ost->st->codec;
     AVPacket pkt;
+    int64_t start;
     int got_packet = 0;
 
     av_init_packet(&pkt);
@@ -1578,12 +2559,21 @@ static void do_audio_out(AVFormatContext *s, OutputStream *ost,
         frame->pts = ost->sync_opts;
     ost->sync_opts = frame->pts + frame->nb_samples;
 
+#if HAVE_PTHREADS
+    if (pipeline_frames > 0) {
+        encode_frame_pipelined(s, ost, frame);
+        return;
+    }
+#endif
+
     av_assert0(pkt.size || !pkt.data);
     update_benchmark(NULL);
+    start = profile_start();
     if (avcodec_encode_audio2(enc, &pkt, frame, &got_packet) < 0) {
         av_log(NULL, AV_LOG_FATAL, "Audio encoding failed (avcodec_encode_audio2)\n");
         exit_program(1);
     }
+    profile_end(&ost->prof_encode, start, 1);
     update_benchmark("encode_audio %d.%d", ost->file_index, ost->index);
 
     if (got_packet) {
@@ -1712,6 +2702,247 @@ static void do_subtitle_out(AVFormatContext *s,
     }
 }
 
+#if HAVE_PTHREADS
+/* the chunk threads open and close their encoders concurrently */
+static int codec_lockmgr(void **mutex, enum AVLockOp op)
+{
+    pthread_mutex_t **m = (pthread_mutex_t **)mutex;
+
+    switch (op) {
+    case AV_LOCK_CREATE:
+        if (!(*m = av_malloc(sizeof(**m))))
+            return 1;
+        if (pthread_mutex_init(*m, NULL)) {
+            av_freep(m);
+            return 1;
+        }
+        return 0;
+    case AV_LOCK_OBTAIN:
+        return !!pthread_mutex_lock(*m);
+    case AV_LOCK_RELEASE:
+        return !!pthread_mutex_unlock(*m);
+    case AV_LOCK_DESTROY:
+        pthread_mutex_destroy(*m);
+        av_freep(m);
+        return 0;
+    }
+    return 1;
+}
+
+/* frames between two segment split points, encoded by their own encoder */
+typedef struct EncodeChunk {
+    OutputStream *ost;
+    AVFrame **frames;
+    int nb_frames;
+    AVPacket *pkts;
+    int nb_pkts;
+    int gop_frames;     /* frames since the last key frame, this one included */
+    int error;
+    pthread_t thread;
+} EncodeChunk;
+
+static void free_encode_chunk(EncodeChunk **pc)
+{
+    EncodeChunk *c = *pc;
+    int i;
+
+    if (!c)
+        return;
+    for (i = 0; i < c->nb_frames; i++)
+        free_frame_copy(&c->frames[i]);
+    for (i = 0; i < c->nb_pkts; i++)
+        av_free_packet(&c->pkts[i]);
+    av_free(c->frames);
+    av_free(c->pkts);
+    av_freep(pc);
+}
+
+static int encode_chunk_packet(EncodeChunk *c, AVCodecContext *enc, AVFrame *frame)
+{
+    AVPacket pkt, *pkts;
+    int64_t start = profile_start();
+    int ret, got_packet;
+
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+
+    ret = avcodec_encode_video2(enc, &pkt, frame, &got_packet);
+    profile_end(&c->ost->prof_encode, start, !!frame);
+    if (ret < 0 || !got_packet)
+        return ret;
+
+    if (pkt.pts == AV_NOPTS_VALUE && frame && !(enc->codec->capabilities & CODEC_CAP_DELAY))
+        pkt.pts = frame->pts;
+
+    if (!(pkts = av_realloc(c->pkts, (c->nb_pkts + 1) * sizeof(*c->pkts)))) {
+        av_free_packet(&pkt);
+        return AVERROR(ENOMEM);
+    }
+    c->pkts = pkts;
+    c->pkts[c->nb_pkts++] = pkt;
+
+    return 1;
+}
+
+static void *encode_chunk_thread(void *arg)
+{
+    EncodeChunk   *c = arg;
+    OutputStream *ost = c->ost;
+    AVCodecContext *enc;
+    AVDictionary *opts = NULL;
+    int i, ret;
+
+    /* no codec here, avcodec_copy_context() would drop its private context */
+    if (!(enc = avcodec_alloc_context3(NULL))) {
+        c->error = AVERROR(ENOMEM);
+        return NULL;
+    }
+    av_dict_copy(&opts, ost->chunk_opts, 0);
+    if ((ret = avcodec_copy_context(enc, ost->chunk_template)) < 0 ||
+        (ret = avcodec_open2(enc, ost->enc, &opts)) < 0)
+        goto end;
+
+    for (i = 0; i < c->nb_frames; i++)
+        if ((ret = encode_chunk_packet(c, enc, c->frames[i])) < 0)
+            goto end;
+    while ((ret = encode_chunk_packet(c, enc, NULL)) > 0)
+        ;
+
+end:
+    c->error = ret;
+    av_dict_free(&opts);
+    free_codec_context(&enc);
+
+    /* the frames are not needed anymore, release them before the chunk is written */
+    for (i = 0; i < c->nb_frames; i++)
+        free_frame_copy(&c->frames[i]);
+    c->nb_frames = 0;
+    return NULL;
+}
+
+/* wait for the oldest chunk of ost and write its packets */
+static void write_encode_chunk(AVFormatContext *s, OutputStream *ost)
+{
+    AVCodecContext *enc = ost->st->codec;
+    EncodeChunk *c = ost->chunks[0];
+    int i;
+
+    pthread_join(c->thread, NULL);
+    memmove(ost->chunks, ost->chunks + 1, --ost->nb_chunks * sizeof(*ost->chunks));
+
+    if (c->error < 0) {
+        free_encode_chunk(&c);
+        av_log(NULL, AV_LOG_FATAL, "Video encoding failed\n");
+        exit_program(1);
+    }
+
+    for (i = 0; i < c->nb_pkts; i++) {
+        AVPacket *pkt = &c->pkts[i];
+
+        if (pkt->pts != AV_NOPTS_VALUE)
+            pkt->pts = av_rescale_q(pkt->pts, enc->time_base, ost->st->time_base);
+        if (pkt->dts != AV_NOPTS_VALUE)
+            pkt->dts = av_rescale_q(pkt->dts, enc->time_base, ost->st->time_base);
+        write_frame(s, pkt, ost);
+        video_size += pkt->size;
+    }
+    free_encode_chunk(&c);
+}
+
+/* hand the chunk being filled over to a new encoding thread */
+static void submit_encode_chunk(AVFormatContext *s, OutputStream *ost)
+{
+    int ret;
+
+    if (!ost->chunk)
+        return;
+
+    while (ost->nb_chunks >= chunk_threads)
+        write_encode_chunk(s, ost);
+
+    if ((ret = pthread_create(&ost->chunk->thread, NULL, encode_chunk_thread, ost->chunk))) {
+        av_log(NULL, AV_LOG_FATAL, "Could not create encoding thread: %s\n", strerror(ret));
+        exit_program(1);
+    }
+    ost->chunks[ost->nb_chunks++] = ost->chunk;
+    ost->chunk = NULL;
+}
+
+static void add_chunk_frame(AVFormatContext *s, OutputStream *ost,
+                            const AVFrame *picture, int split)
+{
+    AVCodecContext *enc = ost->st->codec;
+    EncodeChunk *c;
+    AVFrame **frames;
+
+    /* long segments are cut into several chunks so that the buffered frames
+     * stay bounded, but only where the serial encoder would start a new GOP
+     * anyway: at a key frame forced by the user or after gop_size frames */
+    if (!split && ost->chunk && ost->chunk->nb_frames >= chunk_frames &&
+        (picture->pict_type == AV_PICTURE_TYPE_I ||
+         ost->chunk->gop_frames >= enc->gop_size)) {
+        av_log(NULL, AV_LOG_VERBOSE, "Output stream #%d:%d: segment longer than "
+               "%d frames, starting a new chunk at the next GOP\n",
+               ost->file_index, ost->index, chunk_frames);
+        split = 1;
+    }
+    if (split)
+        submit_encode_chunk(s, ost);
+    if (!ost->chunk && !(ost->chunk = av_mallocz(sizeof(*ost->chunk))))
+        goto fail;
+    c = ost->chunk;
+    c->ost = ost;
+
+    if (!(frames = av_realloc(c->frames, (c->nb_frames + 1) * sizeof(*c->frames))))
+        goto fail;
+    c->frames = frames;
+    if (!(c->frames[c->nb_frames] = copy_video_frame(picture, enc->pix_fmt,
+                                                     enc->width, enc->height)))
+        goto fail;
+    if (!c->nb_frames || picture->pict_type == AV_PICTURE_TYPE_I ||
+        c->gop_frames >= enc->gop_size)
+        c->gop_frames = 1;
+    else
+        c->gop_frames++;
+    c->nb_frames++;
+    return;
+
+fail:
+    av_log(NULL, AV_LOG_FATAL, "Could not queue frame for chunked encoding.\n");
+    exit_program(1);
+}
+
+static void flush_encode_chunks(AVFormatContext *s, OutputStream *ost)
+{
+    submit_encode_chunk(s, ost);
+    while (ost->nb_chunks)
+        write_encode_chunk(s, ost);
+}
+
+/**
+ * Wait for the encoding threads of all the chunks and drop the chunks.
+ * Called when exiting, the threads use the OutputStream of their chunk.
+ */
+static void free_encode_chunks(void)
+{
+    int i;
+
+    for (i = 0; i < nb_output_streams; i++) {
+        OutputStream *ost = output_streams[i];
+
+        if (!ost)
+            continue;
+        while (ost->nb_chunks) {
+            EncodeChunk *c = ost->chunks[--ost->nb_chunks];
+            pthread_join(c->thread, NULL);
+            free_encode_chunk(&c);
+        }
+        free_encode_chunk(&ost->chunk);
+    }
+}
+#endif
+
 static void do_video_out(AVFormatContext *s,
                          OutputStream *ost,
                          AVFrame *in_picture,
@@ -1720,6 +2951,7 @@ static void do_video_out(AVFormatContext *s,
     int ret, format_video_sync;
     AVPacket pkt;
     AVCodecContext *enc = ost->st->codec;
+    int64_t start;
     int nb_frames;
     double sync_ipts, delta;
     double duration = 0;
@@ -1797,7 +3029,7 @@ duplicate_frame:
         write_frame(s, &pkt, ost);
         video_size += pkt.size;
     } else {
-        int got_packet;
+        int got_packet, split = 0;
         AVFrame big_picture;
 
         big_picture = *in_picture;
@@ -1821,8 +3053,30 @@ duplicate_frame:
             big_picture.pict_type = AV_PICTURE_TYPE_I;
             ost->forced_kf_index++;
         }
+        /* frame_number counts the frames given to the encoder, duplicates
+         * included, which all reach the muxer: at the keyframes of closed
+         * GOPs, it is the number of packets of the stream the muxer counts */
+        if (ost->forced_kf_segment &&
+            (split = av_segment_is_split_point(s, ost->index, ost->frame_number,
+                                               big_picture.pts, ost->segment_splits,
+                                               enc->time_base) > 0)) {
+            big_picture.pict_type = AV_PICTURE_TYPE_I;
+            ost->segment_splits++;
+        }
+#if HAVE_PTHREADS
+        if (ost->chunks) {
+            add_chunk_frame(s, ost, &big_picture, split);
+            goto next_frame;
+        }
+        if (pipeline_frames > 0 && !vstats_filename) {
+            encode_frame_pipelined(s, ost, &big_picture);
+            goto next_frame;
+        }
+#endif
         update_benchmark(NULL);
+        start = profile_start();
         ret = avcodec_encode_video2(enc, &pkt, &big_picture, &got_packet);
+        profile_end(&ost->prof_encode, start, 1);
         update_benchmark("encode_video %d.%d", ost->file_index, ost->index);
         if (ret < 0) {
             av_log(NULL, AV_LOG_FATAL, "Video encoding failed\n");
@@ -1856,6 +3110,7 @@ duplicate_frame:
             }
         }
     }
+next_frame:
     ost->sync_opts++;
     /*
      * For video, number of frames in == number of packets out.
@@ -1939,8 +3194,10 @@ static int poll_filters(void)
             filtered_frame = ost->filtered_frame;
 
             while (!ost->is_past_recording_time) {
+                int64_t start = profile_start();
                 ret = av_buffersink_get_buffer_ref(ost->filter->filter, &picref,
                                                    AV_BUFFERSINK_FLAG_NO_REQUEST);
+                profile_end(&ost->filter->graph->prof_filter, start, ret >= 0);
                 if (ret < 0) {
                     if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
                         char buf[256];
@@ -1963,6 +3220,13 @@ static int poll_filters(void)
                         avfilter_unref_buffer(picref);
                         continue;
                     }
+                    /* the interrupted run wrote these already */
+                    if (of->resuming &&
+                        av_rescale_q(frame_pts, ost->st->codec->time_base,
+                                     AV_TIME_BASE_Q) < of->resume_pts) {
+                        avfilter_unref_buffer(picref);
+                        continue;
+                    }
                 }
                 //if (ost->source_index >= 0)
                 //    *filtered_frame= *input_streams[ost->source_index]->decoded_frame; //for me_threshold
@@ -1995,7 +3259,9 @@ static int poll_filters(void)
         /* Request frames through all the graphs */
         ret_all = nb_success = nb_eof = 0;
         for (i = 0; i < nb_filtergraphs; i++) {
+            int64_t start = profile_start();
             ret = avfilter_graph_request_oldest(filtergraphs[i]->graph);
+            profile_end(&filtergraphs[i]->prof_filter, start, 0);
             if (!ret) {
                 nb_success++;
             } else if (ret == AVERROR_EOF) {
@@ -2008,11 +3274,145 @@ static int poll_filters(void)
                 ret_all = ret;
             }
         }
-        if (!nb_success)
-            break;
-        /* Try again if anything succeeded */
+        if (!nb_success)
+            break;
+        /* Try again if anything succeeded */
+    }
+    return nb_eof == nb_filtergraphs ? AVERROR_EOF : ret_all;
+}
+
+static void write_profile_counter(const char *name, const char *unit,
+                                  ProfileCounter *c, int64_t elapsed)
+{
+    ProfileCounter v = profile_read(c);
+
+    fprintf(stage_stats_file, "\"%s\":%0.6f,\"%s\":%"PRId64, name, v.time / 1000000.0,
+            unit, v.count);
+    if (elapsed > 0)
+        fprintf(stage_stats_file, ",\"fps\":%0.2f", v.count * 1000000.0 / elapsed);
+}
+
+/*
+ * Write the time spent in each stage of the pipeline, the number of frames
+ * or packets that went through it and the depth of the queues in front of
+ * it to -stage_stats_file as one JSON object per line.
+ */
+static void write_stage_stats(int is_last_report, int64_t timer_start, int64_t cur_time)
+{
+    static int64_t last_time = -1;
+    int64_t elapsed = cur_time - timer_start;
+    int i, j;
+
+    if (!stage_stats_file)
+        return;
+    if (!is_last_report) {
+        if (last_time == -1) {
+            last_time = cur_time;
+            return;
+        }
+        if (cur_time - last_time < 500000)
+            return;
+        last_time = cur_time;
+    }
+
+    fprintf(stage_stats_file, "{\"time\":%0.3f,\"final\":%s,",
+            elapsed / 1000000.0, is_last_report ? "true" : "false");
+    fprintf(stage_stats_file, "\"input_wait\":%0.6f,",
+            profile_read(&input_wait_prof).time / 1000000.0);
+
+    fprintf(stage_stats_file, "\"inputs\":[");
+    for (i = 0; i < nb_input_files; i++) {
+        InputFile *f = input_files[i];
+        int queued = 0;
+
+#if HAVE_PTHREADS
+        if (f->queue)
+            queued = f->queue_in - f->queue_out;
+#endif
+        fprintf(stage_stats_file, "%s{\"file\":%d,", i ? "," : "", i);
+        write_profile_counter("demux", "packets", &f->prof_demux, 0);
+        fprintf(stage_stats_file, ",\"queue\":%d,\"streams\":[", queued);
+        for (j = 0; j < f->nb_streams; j++) {
+            InputStream *ist = input_streams[f->ist_index + j];
+            queued = 0;
+
+#if HAVE_PTHREADS
+            if (ist->decode_stage)
+                queued = ist->decode_stage->nb_pending;
+#endif
+            fprintf(stage_stats_file, "%s{\"stream\":%d,\"type\":\"%s\",", j ? "," : "", j,
+                    (char *)av_x_if_null(av_get_media_type_string(ist->st->codec->codec_type),
+                                         "unknown"));
+            write_profile_counter("decode", "frames", &ist->prof_decode, elapsed);
+            fprintf(stage_stats_file, ",\"queue\":%d}", queued);
+        }
+        fprintf(stage_stats_file, "]}");
+    }
+
+    fprintf(stage_stats_file, "],\"filters\":[");
+    for (i = 0; i < nb_filtergraphs; i++) {
+        fprintf(stage_stats_file, "%s{\"graph\":%d,", i ? "," : "", i);
+        write_profile_counter("filter", "frames", &filtergraphs[i]->prof_filter, elapsed);
+        fprintf(stage_stats_file, "}");
+    }
+
+    fprintf(stage_stats_file, "],\"outputs\":[");
+    for (i = 0; i < nb_output_files; i++) {
+        OutputFile *of = output_files[i];
+        int64_t mux_wait = 0;
+        int queued = 0;
+
+#if HAVE_PTHREADS
+        if (of->mux_queue) {
+            pthread_mutex_lock(&of->mux_lock);
+            queued   = av_fifo_size(of->mux_queue) / sizeof(AVPacket);
+            mux_wait = of->mux_wait_time;
+            pthread_mutex_unlock(&of->mux_lock);
+        }
+#endif
+        fprintf(stage_stats_file, "%s{\"file\":%d,", i ? "," : "", i);
+        write_profile_counter("mux", "packets", &of->prof_mux, 0);
+        fprintf(stage_stats_file, ",\"mux_wait\":%0.6f,\"queue\":%d,\"streams\":[",
+                mux_wait / 1000000.0, queued);
+        for (j = 0; j < of->ctx->nb_streams; j++) {
+            OutputStream *ost = output_streams[of->ost_index + j];
+            queued = 0;
+
+#if HAVE_PTHREADS
+            if (ost->encode_stage)
+                queued = ost->encode_stage->nb_pending;
+#endif
+            fprintf(stage_stats_file, "%s{\"stream\":%d,\"type\":\"%s\",", j ? "," : "", j,
+                    (char *)av_x_if_null(av_get_media_type_string(ost->st->codec->codec_type),
+                                         "unknown"));
+            write_profile_counter("encode", "frames", &ost->prof_encode, elapsed);
+            fprintf(stage_stats_file, ",\"queue\":%d}", queued);
+        }
+        fprintf(stage_stats_file, "]}");
+    }
+    fprintf(stage_stats_file, "]}\n");
+    fflush(stage_stats_file);
+
+    if (is_last_report) {
+        ProfileCounter demux = { 0 }, decode = { 0 }, filter = { 0 }, encode = { 0 }, mux = { 0 };
+
+        for (i = 0; i < nb_input_files; i++)
+            demux.time  += profile_read(&input_files[i]->prof_demux).time;
+        for (i = 0; i < nb_input_streams; i++)
+            decode.time += profile_read(&input_streams[i]->prof_decode).time;
+        for (i = 0; i < nb_filtergraphs; i++)
+            filter.time += profile_read(&filtergraphs[i]->prof_filter).time;
+        for (i = 0; i < nb_output_streams; i++)
+            encode.time += profile_read(&output_streams[i]->prof_encode).time;
+        for (i = 0; i < nb_output_files; i++)
+            mux.time    += profile_read(&output_files[i]->prof_mux).time;
+
+        av_log(NULL, AV_LOG_INFO, "Stage times: demux=%0.3fs input_wait=%0.3fs decode=%0.3fs "
+               "filter=%0.3fs encode=%0.3fs mux=%0.3fs real=%0.3fs\n",
+               demux.time / 1000000.0, profile_read(&input_wait_prof).time / 1000000.0,
+               decode.time / 1000000.0, filter.time / 1000000.0,
+               encode.time / 1000000.0, mux.time / 1000000.0, elapsed / 1000000.0);
     }
-    return nb_eof == nb_filtergraphs ? AVERROR_EOF : ret_all;
 }
 
 static void print_report(int is_last_report, int64_t timer_start, int64_t cur_time)
@@ -2024,7 +3424,7 @@ static void print_report(int is_last_report, int64_t timer_start, int64_t cur_ti
     AVCodecContext *enc;
     int frame_number, vid, i;
     double bitrate;
-    int64_t pts = INT64_MAX;
+    int64_t pts = INT64_MAX, stream_pts;
     static int64_t last_time = -1;
     static int qp_histogram[52];
     int hours, mins, secs, us;
@@ -2045,6 +3445,11 @@ static void print_report(int is_last_report, int64_t timer_start, int64_t cur_ti
 
     oc = output_files[0]->ctx;
 
+#if HAVE_PTHREADS
+    if (output_files[0]->mux_queue)
+        total_size = mux_thread_size(output_files[0]);
+    else
+#endif
     total_size = avio_size(oc->pb);
     if (total_size < 0) { // FIXME improve avio_size() so it works with non seekable output too
         total_size = avio_tell(oc->pb);
@@ -2058,7 +3463,9 @@ static void print_report(int is_last_report, int64_t timer_start, int64_t cur_ti
         float q = -1;
         ost = output_streams[i];
         enc = ost->st->codec;
-        if (!ost->stream_copy && enc->coded_frame)
+        if (ost->encode_stage)
+            q = ost->stage_quality / (float)FF_QP2LAMBDA;
+        else if (!ost->stream_copy && enc->coded_frame)
             q = enc->coded_frame->quality / (float)FF_QP2LAMBDA;
         if (vid && enc->codec_type == AVMEDIA_TYPE_VIDEO) {
             snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "q=%2.1f ", q);
@@ -2087,11 +3494,13 @@ static void print_report(int is_last_report, int64_t timer_start, int64_t cur_ti
                 char type[3] = { 'Y','U','V' };
                 snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "PSNR=");
                 for (j = 0; j < 3; j++) {
+                    /* the encoder threads are joined before the last report */
                     if (is_last_report) {
                         error = enc->error[j];
                         scale = enc->width * enc->height * 255.0 * 255.0 * frame_number;
                     } else {
-                        error = enc->coded_frame->error[j];
+                        error = ost->encode_stage ? ost->stage_error[j] :
+                                                    enc->coded_frame->error[j];
                         scale = enc->width * enc->height * 255.0 * 255.0;
                     }
                     if (j)
@@ -2105,7 +3514,14 @@ static void print_report(int is_last_report, int64_t timer_start, int64_t cur_ti
             vid = 1;
         }
         /* compute min output value */
-        pts = FFMIN(pts, av_rescale_q(ost->st->pts.val,
+#if HAVE_PTHREADS
+        /* the mux thread owns st->pts and publishes it after each write */
+        if (output_files[ost->file_index]->mux_queue)
+            stream_pts = mux_thread_stream_pts(output_files[ost->file_index], ost->index);
+        else
+#endif
+        stream_pts = ost->st->pts.val;
+        pts = FFMIN(pts, av_rescale_q(stream_pts,
                                       ost->st->time_base, AV_TIME_BASE_Q));
     }
 
@@ -2163,6 +3579,16 @@ static void flush_encoders(void)
         if (!ost->encoding_needed)
             continue;
 
+#if HAVE_PTHREADS
+        if (ost->chunks) {
+            flush_encode_chunks(os, ost);
+            continue;
+        }
+        if (ost->encode_stage) {
+            encode_frame_pipelined(os, ost, NULL);
+            continue;
+        }
+#endif
         if (ost->st->codec->codec_type == AVMEDIA_TYPE_AUDIO && enc->frame_size <= 1)
             continue;
         if (ost->st->codec->codec_type == AVMEDIA_TYPE_VIDEO && (os->oformat->flags & AVFMT_RAWPICTURE) && enc->codec->id == CODEC_ID_RAWVIDEO)
@@ -2191,6 +3617,7 @@ static void flush_encoders(void)
             if (encode) {
                 AVPacket pkt;
                 int got_packet;
+                int64_t start = profile_start();
                 av_init_packet(&pkt);
                 pkt.data = NULL;
                 pkt.size = 0;
@@ -2198,6 +3625,7 @@ static void flush_encoders(void)
                 update_benchmark(NULL);
                 ret = encode(enc, &pkt, NULL, &got_packet);
                 update_benchmark("flush %s %d.%d", desc, ost->file_index, ost->index);
+                profile_end(&ost->prof_encode, start, 0);
                 if (ret < 0) {
                     av_log(NULL, AV_LOG_FATAL, "%s encoding failed\n", desc);
                     exit_program(1);
@@ -2247,7 +3675,75 @@ static int check_output_constraints(InputStream *ist, OutputStream *ost)
     return 1;
 }
 
-static void do_streamcopy(InputStream *ist, OutputStream *ost, const AVPacket *pkt)
+/*
+ * Stream copied packets share the data of the demuxed packet instead of
+ * having the muxer duplicate it. The data is moved into a PacketRef, which
+ * is freed by the destruct callback of the last packet referencing it.
+ * av_dup_packet() leaves packets with this callback alone, so the references
+ * can be kept by the interleaver and the mux threads.
+ */
+typedef struct PacketRef {
+    AVPacket pkt;       /* the packet owning the data */
+    int refcount;
+} PacketRef;
+
+#if HAVE_PTHREADS
+static pthread_mutex_t packet_ref_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void packet_ref_destruct(AVPacket *pkt)
+{
+    PacketRef *ref = pkt->priv;
+    int refcount;
+
+#if HAVE_PTHREADS
+    pthread_mutex_lock(&packet_ref_lock);
+#endif
+    refcount = --ref->refcount;
+#if HAVE_PTHREADS
+    pthread_mutex_unlock(&packet_ref_lock);
+#endif
+    if (!refcount) {
+        av_free_packet(&ref->pkt);
+        av_free(ref);
+    }
+    pkt->priv     = NULL;
+    pkt->destruct = NULL;
+}
+
+/* make dst reference the data of src, moving the data of src into a PacketRef */
+static int ref_packet_data(AVPacket *dst, AVPacket *src)
+{
+    PacketRef *ref = src->priv;
+    int ret;
+
+    if (src->destruct != packet_ref_destruct) {
+        if ((ret = av_dup_packet(src)) < 0)
+            return ret;
+        if (!(ref = av_malloc(sizeof(*ref))))
+            return AVERROR(ENOMEM);
+        ref->pkt      = *src;
+        ref->refcount = 1;
+        src->destruct = packet_ref_destruct;
+        src->priv     = ref;
+    }
+
+#if HAVE_PTHREADS
+    pthread_mutex_lock(&packet_ref_lock);
+#endif
+    ref->refcount++;
+#if HAVE_PTHREADS
+    pthread_mutex_unlock(&packet_ref_lock);
+#endif
+    dst->data     = src->data;
+    dst->size     = src->size;
+    dst->destruct = packet_ref_destruct;
+    dst->priv     = ref;
+    return 0;
+}
+
+/* the data of pkt may be shared with the output packet */
+static void do_streamcopy(InputStream *ist, OutputStream *ost, AVPacket *pkt)
 {
     OutputFile *of = output_files[ost->file_index];
     int64_t ost_tb_start_time = av_rescale_q(of->start_time, AV_TIME_BASE_Q, ost->st->time_base);
@@ -2283,6 +3779,7 @@ static void do_streamcopy(InputStream *ist, OutputStream *ost, const AVPacket *p
 
     opkt.duration = av_rescale_q(pkt->duration, ist->st->time_base, ost->st->time_base);
     opkt.flags    = pkt->flags;
+    opkt.pos      = pkt->pos;
 
     // FIXME remove the following 2 lines they shall be replaced by the bitstream filters
     if (  ost->st->codec->codec_id != CODEC_ID_H264
@@ -2296,6 +3793,13 @@ static void do_streamcopy(InputStream *ist, OutputStream *ost, const AVPacket *p
         opkt.data = pkt->data;
         opkt.size = pkt->size;
     }
+    /* raw pictures point into the data, which must stay owned by pkt */
+    if (!opkt.destruct && opkt.data == pkt->data && opkt.size == pkt->size &&
+        !(of->ctx->oformat->flags & AVFMT_RAWPICTURE) &&
+        ref_packet_data(&opkt, pkt) < 0) {
+        av_log(NULL, AV_LOG_FATAL, "Could not reference packet data\n");
+        exit_program(1);
+    }
     if (of->ctx->oformat->flags & AVFMT_RAWPICTURE) {
         /* store AVPicture in AVPacket, as expected by the output format */
         avpicture_fill(&pict, opkt.data, ost->st->codec->pix_fmt, ost->st->codec->width, ost->st->codec->height);
@@ -2341,6 +3845,7 @@ static int decode_audio(InputStream *ist, AVPacket *pkt, int *got_output)
 {
     AVFrame *decoded_frame;
     AVCodecContext *avctx = ist->st->codec;
+    int64_t start;
     int i, ret, resample_changed;
 
     if (!ist->decoded_frame && !(ist->decoded_frame = avcodec_alloc_frame()))
@@ -2350,7 +3855,9 @@ static int decode_audio(InputStream *ist, AVPacket *pkt, int *got_output)
     decoded_frame = ist->decoded_frame;
 
     update_benchmark(NULL);
+    start = profile_start();
     ret = avcodec_decode_audio4(avctx, decoded_frame, got_output, pkt);
+    profile_end(&ist->prof_decode, start, !!*got_output);
     update_benchmark("decode_audio %d.%d", ist->file_index, ist->st->index);
     if (ret < 0) {
         return ret;
@@ -2450,7 +3957,7 @@ static int decode_audio(InputStream *ist, AVPacket *pkt, int *got_output)
 
 static int decode_video(InputStream *ist, AVPacket *pkt, int *got_output)
 {
-    AVFrame *decoded_frame;
+    AVFrame *decoded_frame, *pipelined_frame = NULL;
     void *buffer_to_free = NULL;
     int i, ret = 0, resample_changed;
     int64_t best_effort_timestamp;
@@ -2464,12 +3971,23 @@ static int decode_video(InputStream *ist, AVPacket *pkt, int *got_output)
     decoded_frame = ist->decoded_frame;
     pkt->dts  = av_rescale_q(ist->dts, AV_TIME_BASE_Q, ist->st->time_base);
 
-    update_benchmark(NULL);
-    ret = avcodec_decode_video2(ist->st->codec,
-                                decoded_frame, got_output, pkt);
-    update_benchmark("decode_video %d.%d", ist->file_index, ist->st->index);
+#if HAVE_PTHREADS
+    if (pipeline_frames > 0) {
+        ret = decode_video_pipelined(ist, pkt, got_output, &pipelined_frame);
+        if (pipelined_frame)
+            decoded_frame = pipelined_frame;
+    } else
+#endif
+    {
+        int64_t start = profile_start();
+        update_benchmark(NULL);
+        ret = avcodec_decode_video2(ist->st->codec,
+                                    decoded_frame, got_output, pkt);
+        update_benchmark("decode_video %d.%d", ist->file_index, ist->st->index);
+        profile_end(&ist->prof_decode, start, !!*got_output);
+    }
     if (ret < 0)
-        return ret;
+        goto end;
 
     quality = same_quant ? decoded_frame->quality : 0;
     if (!*got_output) {
@@ -2477,7 +3995,7 @@ static int decode_video(InputStream *ist, AVPacket *pkt, int *got_output)
         if (!pkt->size)
             for (i = 0; i < ist->nb_filters; i++)
                 av_buffersrc_add_ref(ist->filters[i]->filter, NULL, AV_BUFFERSRC_FLAG_NO_COPY);
-        return ret;
+        goto end;
     }
 
     if(ist->top_field_first>=0)
@@ -2554,6 +4072,10 @@ static int decode_video(InputStream *ist, AVPacket *pkt, int *got_output)
     }
 
     av_free(buffer_to_free);
+end:
+#if HAVE_PTHREADS
+    free_frame_copy(&pipelined_frame);
+#endif
     return ret;
 }
 
@@ -2583,7 +4105,7 @@ static int transcode_subtitles(InputStream *ist, AVPacket *pkt, int *got_output)
 }
 
 /* pkt = NULL means EOF (needed to flush decoder buffers) */
-static int output_packet(InputStream *ist, const AVPacket *pkt)
+static int output_packet(InputStream *ist, AVPacket *pkt)
 {
     int ret = 0, i;
     int got_output;
@@ -2640,23 +4162,17 @@ static int output_packet(InputStream *ist, const AVPacket *pkt)
             break;
         case AVMEDIA_TYPE_VIDEO:
             ret = decode_video    (ist, &avpkt, &got_output);
-            if (avpkt.duration) {
-                duration = av_rescale_q(avpkt.duration, ist->st->time_base, AV_TIME_BASE_Q);
-            } else if(ist->st->codec->time_base.num != 0 && ist->st->codec->time_base.den != 0) {
-                int ticks= ist->st->parser ? ist->st->parser->repeat_pict+1 : ist->st->codec->ticks_per_frame;
-                duration = ((int64_t)AV_TIME_BASE *
-                                ist->st->codec->time_base.num * ticks) /
-                                ist->st->codec->time_base.den;
-            } else
-                duration = 0;
+            duration = video_packet_duration(ist, ist->st->codec, &avpkt,
+                                             ist->st->parser ? ist->st->parser->repeat_pict : -1);
 
             if(ist->dts != AV_NOPTS_VALUE && duration) {
                 ist->next_dts += duration;
             }else
                 ist->next_dts = AV_NOPTS_VALUE;
 
+            /* a pipelined decoder returns the frame of an earlier packet */
             if (got_output)
-                ist->next_pts += duration; //FIXME the duration is not correct in some cases
+                ist->next_pts += ist->decode_stage ? ist->frame_duration : duration; //FIXME the duration is not correct in some cases
             break;
         case AVMEDIA_TYPE_SUBTITLE:
             ret = transcode_subtitles(ist, &avpkt, &got_output);
@@ -2747,7 +4263,10 @@ static int init_input_stream(int ist_index, char *error, int error_len)
             return AVERROR(EINVAL);
         }
 
-        ist->dr1 = (codec->capabilities & CODEC_CAP_DR1) && !do_deinterlace;
+        /* with -pipeline_frames, video decoders allocate their buffers on
+         * their own thread, the frames are copied out of them */
+        ist->dr1 = (codec->capabilities & CODEC_CAP_DR1) && !do_deinterlace &&
+                   !(codec->type == AVMEDIA_TYPE_VIDEO && pipeline_frames > 0);
         if (codec->type == AVMEDIA_TYPE_VIDEO && ist->dr1) {
             ist->st->codec->get_buffer     = codec_get_buffer;
             ist->st->codec->release_buffer = codec_release_buffer;
@@ -2756,6 +4275,20 @@ static int init_input_stream(int ist_index, char *error, int error_len)
 
         if (!av_dict_get(ist->opts, "threads", NULL, 0))
             av_dict_set(&ist->opts, "threads", "auto", 0);
+#if HAVE_PTHREADS
+        /* the decoder thread opens its own copy of the decoder, the context
+         * of the stream only keeps track of its parameters */
+        if (codec->type == AVMEDIA_TYPE_VIDEO && pipeline_frames > 0) {
+            if (!(ist->stage_template = avcodec_alloc_context3(NULL)) ||
+                avcodec_copy_context(ist->stage_template, ist->st->codec) < 0) {
+                snprintf(error, error_len, "Error while copying the decoder context "
+                         "of input stream #%d:%d", ist->file_index, ist->st->index);
+                return AVERROR(ENOMEM);
+            }
+            av_dict_copy(&ist->stage_opts, ist->opts, 0);
+            av_dict_set(&ist->opts, "threads", "1", 0);
+        }
+#endif
         if (avcodec_open2(ist->st->codec, codec, &ist->opts) < 0) {
             snprintf(error, error_len, "Error while opening decoder for input stream #%d:%d",
                     ist->file_index, ist->st->index);
@@ -2779,6 +4312,15 @@ static InputStream *get_input_stream(OutputStream *ost)
     return NULL;
 }
 
+/*
+ * Check whether oc is written by one of the segment muxers.
+ */
+static int is_segment_muxer(AVFormatContext *oc)
+{
+    return oc->oformat == av_guess_format("segment", NULL, NULL) ||
+           oc->oformat == av_guess_format("stream_segment", NULL, NULL);
+}
+
 static void parse_forced_key_frames(char *kf, OutputStream *ost,
                                     AVCodecContext *avctx)
 {
@@ -2805,6 +4347,32 @@ static void parse_forced_key_frames(char *kf, OutputStream *ost,
     }
 }
 
+static int init_encode_chunks(OutputStream *ost)
+{
+#if HAVE_PTHREADS
+    if (ost->logfile) {
+        av_log(NULL, AV_LOG_WARNING, "Chunked encoding is not possible with "
+               "two pass encoding, output stream #%d:%d is encoded serially.\n",
+               ost->file_index, ost->index);
+        return 0;
+    }
+
+    if (!(ost->chunk_template = avcodec_alloc_context3(NULL)) ||
+        !(ost->chunks = av_mallocz(chunk_threads * sizeof(*ost->chunks))))
+        return AVERROR(ENOMEM);
+    if (avcodec_copy_context(ost->chunk_template, ost->st->codec) < 0)
+        return AVERROR(ENOMEM);
+    av_dict_copy(&ost->chunk_opts, ost->opts, 0);
+    if (!av_dict_get(ost->chunk_opts, "threads", NULL, 0))
+        av_dict_set(&ost->chunk_opts, "threads", "1", 0);
+#else
+    av_log(NULL, AV_LOG_WARNING, "Chunked encoding requires threads, "
+           "output stream #%d:%d is encoded serially.\n",
+           ost->file_index, ost->index);
+#endif
+    return 0;
+}
+
 static int transcode_init(void)
 {
     int ret = 0, i, j, k;
@@ -3039,7 +4607,15 @@ static int transcode_init(void)
                     codec->bits_per_raw_sample = frame_bits_per_raw_sample;
                 }
 
-                if (ost->forced_keyframes)
+                if (ost->forced_keyframes && !strcmp(ost->forced_keyframes, "segment")) {
+                    if (!is_segment_muxer(oc)) {
+                        av_log(NULL, AV_LOG_FATAL, "-force_key_frames segment requires "
+                               "the segment muxer for output stream #%d:%d.\n",
+                               ost->file_index, ost->index);
+                        exit_program(1);
+                    }
+                    ost->forced_kf_segment = 1;
+                } else if (ost->forced_keyframes)
                     parse_forced_key_frames(ost->forced_keyframes, ost,
                                             ost->st->codec);
                 break;
@@ -3103,14 +4679,37 @@ static int transcode_init(void)
                 memcpy(ost->st->codec->subtitle_header, dec->subtitle_header, dec->subtitle_header_size);
                 ost->st->codec->subtitle_header_size = dec->subtitle_header_size;
             }
+            if (chunk_threads > 0 && ost->forced_kf_segment &&
+                codec->type == AVMEDIA_TYPE_VIDEO) {
+                if ((ret = init_encode_chunks(ost)) < 0)
+                    goto dump_format;
+            }
+            /* the encoder of a chunked stream encodes nothing, it is still
+             * opened to check the parameters before anything is written and
+             * to give the muxer the extradata for global headers, which the
+             * chunk encoders opened with the same settings reproduce; it
+             * does not need threads for that */
             if (!av_dict_get(ost->opts, "threads", NULL, 0))
-                av_dict_set(&ost->opts, "threads", "auto", 0);
+                av_dict_set(&ost->opts, "threads", ost->chunks ? "1" : "auto", 0);
             if (avcodec_open2(ost->st->codec, codec, &ost->opts) < 0) {
                 snprintf(error, sizeof(error), "Error while opening encoder for output stream #%d:%d - maybe incorrect parameters such as bit_rate, rate, width or height",
                         ost->file_index, ost->index);
                 ret = AVERROR(EINVAL);
                 goto dump_format;
             }
+#if HAVE_PTHREADS
+            /* each chunk encoder starts its dts at the pts of its first frame
+             * minus its reordering delay, so with reordering the dts would go
+             * back at every chunk; the encoder options are only applied here */
+            if (ost->chunks && ost->st->codec->has_b_frames) {
+                av_log(NULL, AV_LOG_WARNING, "Chunked encoding is not possible "
+                       "with an encoder reordering frames, output stream #%d:%d "
+                       "is encoded serially.\n", ost->file_index, ost->index);
+                free_codec_context(&ost->chunk_template);
+                av_dict_free(&ost->chunk_opts);
+                av_freep(&ost->chunks);
+            }
+#endif
             if (ost->enc->type == AVMEDIA_TYPE_AUDIO &&
                 !(ost->enc->capabilities & CODEC_CAP_VARIABLE_FRAME_SIZE))
                 av_buffersink_set_frame_size(ost->filter->filter,
@@ -3120,6 +4719,11 @@ static int transcode_init(void)
             if (ost->st->codec->bit_rate && ost->st->codec->bit_rate < 1000)
                 av_log(NULL, AV_LOG_WARNING, "The bitrate parameter is set too low."
                                              " It takes bits/s as argument, not kbits/s\n");
+            if (ost->forced_kf_segment && ost->st->codec->max_b_frames &&
+                !(ost->st->codec->flags & CODEC_FLAG_CLOSED_GOP))
+                av_log(NULL, AV_LOG_WARNING, "Output stream #%d:%d uses B-frames without "
+                       "closed GOPs, segments may not start at the planned frames.\n",
+                       ost->file_index, ost->index);
             extra_size += ost->st->codec->extradata_size;
 
             if (ost->st->codec->me_threshold)
@@ -3254,9 +4858,14 @@ static int need_output(void)
         OutputStream *ost    = output_streams[i];
         OutputFile *of       = output_files[ost->file_index];
         AVFormatContext *os  = output_files[ost->file_index]->ctx;
+        int64_t size         = os->pb ? avio_tell(os->pb) : 0;
 
+#if HAVE_PTHREADS
+        if (of->mux_queue)
+            size = mux_thread_size(of);
+#endif
         if (ost->is_past_recording_time ||
-            (os->pb && avio_tell(os->pb) >= of->limit_filesize))
+            (os->pb && size >= of->limit_filesize))
             continue;
         if (ost->frame_number >= ost->max_frames) {
             int j;
@@ -3271,26 +4880,130 @@ static int need_output(void)
     return 0;
 }
 
-static int select_input_file(uint8_t *no_packet)
+/* Input files are read in the order of the pts of their streams. To avoid
+ * scanning all the streams for every packet, each file keeps a min-heap of
+ * its streams and the files are kept in a min-heap ordered by the first
+ * stream of their heap. Ties are broken on the index, which gives the same
+ * order as a linear scan. */
+
+static int input_stream_less(int a, int b)
 {
-    int64_t ipts_min = INT64_MAX;
-    int i, file_index = -1;
+    int64_t pts_a = input_streams[a]->pts, pts_b = input_streams[b]->pts;
+    return pts_a < pts_b || (pts_a == pts_b && a < b);
+}
 
-    for (i = 0; i < nb_input_streams; i++) {
-        InputStream *ist = input_streams[i];
-        int64_t ipts     = ist->pts;
+static int64_t input_file_pts(int file_index)
+{
+    InputFile *f = input_files[file_index];
+    return f->nb_stream_heap ? input_streams[f->stream_heap[0]]->pts : INT64_MAX;
+}
 
-        if (ist->discard || no_packet[ist->file_index])
-            continue;
-        if (!input_files[ist->file_index]->eof_reached) {
-            if (ipts < ipts_min) {
-                ipts_min = ipts;
-                file_index = ist->file_index;
-            }
+static int input_file_less(int a, int b)
+{
+    int64_t pts_a = input_file_pts(a), pts_b = input_file_pts(b);
+    return pts_a < pts_b || (pts_a == pts_b && a < b);
+}
+
+static int *input_stream_heap_index(int i)
+{
+    return &input_streams[i]->heap_index;
+}
+
+static int *input_file_heap_index(int i)
+{
+    return &input_files[i]->heap_index;
+}
+
+/* move heap[pos] up or down until the heap is ordered again */
+static void heap_update(int *heap, int nb, int pos,
+                        int (*less)(int a, int b), int *(*heap_index)(int i))
+{
+    int elem = heap[pos];
+
+    while (pos > 0 && less(elem, heap[(pos - 1) / 2])) {
+        heap[pos] = heap[(pos - 1) / 2];
+        *heap_index(heap[pos]) = pos;
+        pos = (pos - 1) / 2;
+    }
+    for (;;) {
+        int child = 2 * pos + 1;
+        if (child >= nb)
+            break;
+        if (child + 1 < nb && less(heap[child + 1], heap[child]))
+            child++;
+        if (!less(heap[child], elem))
+            break;
+        heap[pos] = heap[child];
+        *heap_index(heap[pos]) = pos;
+        pos = child;
+    }
+    heap[pos] = elem;
+    *heap_index(elem) = pos;
+}
+
+static int init_input_heaps(void)
+{
+    int i, j;
+
+    if (!(input_file_heap = av_malloc(nb_input_files * sizeof(*input_file_heap))))
+        return AVERROR(ENOMEM);
+
+    for (i = 0; i < nb_input_files; i++) {
+        InputFile *f = input_files[i];
+
+        if (!(f->stream_heap = av_malloc(FFMAX(f->nb_streams, 1) * sizeof(*f->stream_heap))))
+            return AVERROR(ENOMEM);
+        for (j = 0; j < f->nb_streams; j++) {
+            int ist_index = f->ist_index + j;
+            if (input_streams[ist_index]->discard)
+                continue;
+            f->stream_heap[f->nb_stream_heap] = ist_index;
+            heap_update(f->stream_heap, f->nb_stream_heap + 1, f->nb_stream_heap,
+                        input_stream_less, input_stream_heap_index);
+            f->nb_stream_heap++;
         }
+        input_file_heap[i] = i;
+        heap_update(input_file_heap, i + 1, i, input_file_less, input_file_heap_index);
     }
+    return 0;
+}
+
+/* restore the order of the heaps after the pts of ist changed */
+static void update_input_heaps(InputStream *ist)
+{
+    InputFile *f = input_files[ist->file_index];
+
+    if (ist->discard)
+        return;
+    heap_update(f->stream_heap, f->nb_stream_heap, ist->heap_index,
+                input_stream_less, input_stream_heap_index);
+    heap_update(input_file_heap, nb_input_files, f->heap_index,
+                input_file_less, input_file_heap_index);
+}
+
+/* find the lowest file at or below pos that can be read from and is lower
+ * than best */
+static int find_input_file(uint8_t *no_packet, int pos, int best)
+{
+    int file_index;
+
+    if (pos >= nb_input_files)
+        return best;
+    file_index = input_file_heap[pos];
+    /* the files below are not lower than this one */
+    if ((best >= 0 && !input_file_less(file_index, best)) ||
+        input_file_pts(file_index) == INT64_MAX)
+        return best;
+    if (!no_packet[file_index] && !input_files[file_index]->eof_reached)
+        return file_index;
+
+    best = find_input_file(no_packet, 2 * pos + 1, best);
+    return find_input_file(no_packet, 2 * pos + 2, best);
+}
 
-    return file_index;
+static int select_input_file(uint8_t *no_packet)
+{
+    return find_input_file(no_packet, 0, -1);
 }
 
 static int check_keyboard_interaction(int64_t cur_time)
@@ -3387,6 +5100,55 @@ static int check_keyboard_interaction(int64_t cur_time)
 }
 
 #if HAVE_PTHREADS
+static void signal_input_event(void)
+{
+    pthread_mutex_lock(&input_event_lock);
+    input_event_seq++;
+    pthread_cond_signal(&input_event_cond);
+    pthread_mutex_unlock(&input_event_lock);
+}
+
+/* wait until an input thread has queued a packet or finished since the
+ * previous call, or until timeout microseconds have passed */
+static void wait_input_event(int64_t timeout)
+{
+    static unsigned seen_seq;
+    int64_t t = av_gettime() + timeout;
+    struct timespec ts = { t / 1000000, (t % 1000000) * 1000 };
+
+    pthread_mutex_lock(&input_event_lock);
+    while (seen_seq == input_event_seq)
+        if (pthread_cond_timedwait(&input_event_cond, &input_event_lock, &ts) == ETIMEDOUT)
+            break;
+    seen_seq = input_event_seq;
+    pthread_mutex_unlock(&input_event_lock);
+}
+
+/* full memory barrier, ordering the accesses to the packet queues */
+static void memory_barrier(void)
+{
+#if HAVE_SYNC_SYNCHRONIZE
+    __sync_synchronize();
+#else
+    /* locking a mutex implies a full barrier */
+    static pthread_mutex_t barrier_lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&barrier_lock);
+    pthread_mutex_unlock(&barrier_lock);
+#endif
+}
+
+/* whether the packet queue of f has no room for a packet of the given size;
+ * a queue holding no packet always accepts one */
+static int input_queue_full(InputFile *f, int size)
+{
+    unsigned nb_packets = f->queue_in - f->queue_out;
+    unsigned bytes      = f->bytes_in - f->bytes_out;
+
+    return nb_packets >= f->queue_size ||
+           (nb_packets && f->queue_max_bytes &&
+            bytes + size > f->queue_max_bytes);
+}
+
 static void *input_thread(void *arg)
 {
     InputFile *f = arg;
@@ -3394,26 +5156,51 @@ static void *input_thread(void *arg)
 
     while (!transcoding_finished && ret >= 0) {
         AVPacket pkt;
+        int64_t start = profile_start();
+        unsigned in;
+
         ret = av_read_frame(f->ctx, &pkt);
+        profile_end(&f->prof_demux, start, ret >= 0);
 
         if (ret == AVERROR(EAGAIN)) {
-            av_usleep(10000);
+            /* the input is read in blocking mode, so the demuxer only
+             * returns EAGAIN after consuming data that did not make up a
+             * packet, e.g. while resyncing; call it again right away */
             ret = 0;
             continue;
         } else if (ret < 0)
             break;
 
-        pthread_mutex_lock(&f->fifo_lock);
-        while (!av_fifo_space(f->fifo))
-            pthread_cond_wait(&f->fifo_cond, &f->fifo_lock);
+        if (input_queue_full(f, pkt.size)) {
+            pthread_mutex_lock(&f->queue_lock);
+            f->writer_waiting = 1;
+            memory_barrier();
+            while (!transcoding_finished && input_queue_full(f, pkt.size))
+                pthread_cond_wait(&f->queue_cond, &f->queue_lock);
+            f->writer_waiting = 0;
+            pthread_mutex_unlock(&f->queue_lock);
+            if (transcoding_finished) {
+                av_free_packet(&pkt);
+                break;
+            }
+        }
 
         av_dup_packet(&pkt);
-        av_fifo_generic_write(f->fifo, &pkt, sizeof(pkt), NULL);
+        in = f->queue_in;
+        f->queue[in & f->queue_mask] = pkt;
+        f->bytes_in += pkt.size;
+        memory_barrier();
+        f->queue_in = in + 1;
+        memory_barrier();
 
-        pthread_mutex_unlock(&f->fifo_lock);
+        /* the main thread may only be waiting if the queue was empty */
+        if (f->queue_out == in)
+            signal_input_event();
     }
 
+    memory_barrier();
     f->finished = 1;
+    signal_input_event();
     return NULL;
 }
 
@@ -3421,34 +5208,27 @@ static void free_input_threads(void)
 {
     int i;
 
-    if (nb_input_files == 1)
-        return;
-
     transcoding_finished = 1;
+    memory_barrier();
 
     for (i = 0; i < nb_input_files; i++) {
         InputFile *f = input_files[i];
-        AVPacket pkt;
 
-        if (!f->fifo || f->joined)
+        if (!f->queue || f->joined)
             continue;
 
-        pthread_mutex_lock(&f->fifo_lock);
-        while (av_fifo_size(f->fifo)) {
-            av_fifo_generic_read(f->fifo, &pkt, sizeof(pkt), NULL);
-            av_free_packet(&pkt);
-        }
-        pthread_cond_signal(&f->fifo_cond);
-        pthread_mutex_unlock(&f->fifo_lock);
+        pthread_mutex_lock(&f->queue_lock);
+        pthread_cond_signal(&f->queue_cond);
+        pthread_mutex_unlock(&f->queue_lock);
 
         pthread_join(f->thread, NULL);
         f->joined = 1;
 
-        while (av_fifo_size(f->fifo)) {
-            av_fifo_generic_read(f->fifo, &pkt, sizeof(pkt), NULL);
-            av_free_packet(&pkt);
-        }
-        av_fifo_free(f->fifo);
+        for (; f->queue_out != f->queue_in; f->queue_out++)
+            av_free_packet(&f->queue[f->queue_out & f->queue_mask]);
+        av_freep(&f->queue);
+        pthread_mutex_destroy(&f->queue_lock);
+        pthread_cond_destroy(&f->queue_cond);
     }
 }
 
@@ -3456,17 +5236,34 @@ static int init_input_threads(void)
 {
     int i, ret;
 
-    if (nb_input_files == 1)
-        return 0;
-
     for (i = 0; i < nb_input_files; i++) {
         InputFile *f = input_files[i];
+        unsigned nb_entries = 1;
+
+        /* a single input is read on the main thread, unless it may have
+         * no packet ready for a while, like devices and network streams */
+        if (nb_input_files == 1 && !(f->ctx->iformat->flags & AVFMT_NOFILE))
+            return 0;
+
+        if (f->queue_size <= 0 || f->queue_max_bytes < 0) {
+            av_log(NULL, AV_LOG_ERROR, "Invalid thread queue size for input file #%d\n", i);
+            return AVERROR(EINVAL);
+        }
+        /* a power of two, so that the entries keep matching the counters
+         * when they wrap around */
+        while (nb_entries < f->queue_size)
+            nb_entries <<= 1;
 
-        if (!(f->fifo = av_fifo_alloc(8*sizeof(AVPacket))))
+        if (!(f->queue = av_malloc(nb_entries * sizeof(*f->queue))))
             return AVERROR(ENOMEM);
+        f->queue_mask = nb_entries - 1;
 
-        pthread_mutex_init(&f->fifo_lock, NULL);
-        pthread_cond_init (&f->fifo_cond, NULL);
+        pthread_mutex_init(&f->queue_lock, NULL);
+        pthread_cond_init (&f->queue_cond, NULL);
+
+        /* nothing else runs on the input thread, so the demuxer may wait
+         * for its next packet instead of returning EAGAIN */
+        f->ctx->flags &= ~AVFMT_FLAG_NONBLOCK;
 
         if ((ret = pthread_create(&f->thread, NULL, input_thread, f)))
             return AVERROR(ret);
@@ -3476,33 +5273,108 @@ static int init_input_threads(void)
 
 static int get_input_packet_mt(InputFile *f, AVPacket *pkt)
 {
-    int ret = 0;
+    int finished = f->finished;
+    unsigned out = f->queue_out;
 
-    pthread_mutex_lock(&f->fifo_lock);
+    /* finished is set after the last packet is queued, so reading it
+     * first guarantees that no packet is missed */
+    memory_barrier();
+    if (f->queue_in == out)
+        return finished ? AVERROR_EOF : AVERROR(EAGAIN);
+    memory_barrier();
 
-    if (av_fifo_size(f->fifo)) {
-        av_fifo_generic_read(f->fifo, pkt, sizeof(*pkt), NULL);
-        pthread_cond_signal(&f->fifo_cond);
-    } else {
-        if (f->finished)
-            ret = AVERROR_EOF;
-        else
-            ret = AVERROR(EAGAIN);
-    }
+    *pkt = f->queue[out & f->queue_mask];
+    f->bytes_out += pkt->size;
+    memory_barrier();
+    f->queue_out = out + 1;
+    memory_barrier();
 
-    pthread_mutex_unlock(&f->fifo_lock);
+    if (f->writer_waiting) {
+        pthread_mutex_lock(&f->queue_lock);
+        pthread_cond_signal(&f->queue_cond);
+        pthread_mutex_unlock(&f->queue_lock);
+    }
 
-    return ret;
+    return 0;
 }
 #endif
 
 static int get_input_packet(InputFile *f, AVPacket *pkt)
 {
+    int64_t start;
+    int ret;
+
 #if HAVE_PTHREADS
-    if (nb_input_files > 1)
+    if (f->queue)
         return get_input_packet_mt(f, pkt);
 #endif
-    return av_read_frame(f->ctx, pkt);
+    start = profile_start();
+    ret = av_read_frame(f->ctx, pkt);
+    profile_end(&f->prof_demux, start, ret >= 0);
+    return ret;
+}
+
+/*
+ * Skip the input already processed by an interrupted run of the segment
+ * muxers resuming from their journal, and start encoding where it stopped.
+ */
+static void seek_to_resume_point(void)
+{
+    int64_t pts = AV_NOPTS_VALUE, pos = -1;
+    int i, j, seek = 1;
+
+    for (i = 0; i < nb_output_files; i++) {
+        OutputFile *of = output_files[i];
+        int64_t file_pts, file_pos;
+
+        /* seeking is only possible when every output resumes, from the earliest point */
+        if (!is_segment_muxer(of->ctx) ||
+            av_segment_get_resume_point(of->ctx, &file_pts, &file_pos) <= 0) {
+            seek = 0;
+            continue;
+        }
+        if (!i || file_pts == AV_NOPTS_VALUE ||
+            (pts != AV_NOPTS_VALUE && file_pts < pts))
+            pts = file_pts;
+        if (!i || file_pos < 0 || (pos >= 0 && file_pos < pos))
+            pos = file_pos;
+
+        if (file_pts == AV_NOPTS_VALUE)
+            continue;
+
+        /* drop the frames preceding the resume point instead of encoding
+         * them, and keep the encoders from filling the gap up to it */
+        of->resuming   = 1;
+        of->resume_pts = file_pts;
+        for (j = 0; j < of->ctx->nb_streams; j++) {
+            OutputStream *ost = output_streams[of->ost_index + j];
+            if (!ost->stream_copy)
+                ost->sync_opts = av_rescale_q(file_pts, AV_TIME_BASE_Q,
+                                              ost->st->codec->time_base);
+        }
+    }
+    if (!seek)
+        return;
+
+    for (i = 0; i < nb_input_files; i++) {
+        InputFile *f = input_files[i];
+        int ret;
+
+        if (nb_input_files == 1 && pos >= 0 &&
+            !(f->ctx->iformat->flags & AVFMT_NO_BYTE_SEEK)) {
+            ret = avformat_seek_file(f->ctx, -1, INT64_MIN, pos, pos, AVSEEK_FLAG_BYTE);
+        } else if (pts != AV_NOPTS_VALUE) {
+            int64_t ts = pts - f->ts_offset;
+            ret = avformat_seek_file(f->ctx, -1, INT64_MIN, ts, ts, 0);
+        } else
+            ret = AVERROR(ENOSYS);
+
+        if (ret < 0)
+            av_log(NULL, AV_LOG_WARNING, "Could not seek input file #%d to the resume point, "
+                   "reading it from the start.\n", i);
+        else
+            av_log(NULL, AV_LOG_INFO, "Input file #%d seeked to the resume point.\n", i);
+    }
 }
 
 /*
@@ -3516,7 +5388,7 @@ static int transcode(void)
     InputStream *ist;
     uint8_t *no_packet;
     int no_packet_count = 0;
-    int64_t timer_start;
+    int64_t timer_start, end_time;
 
     if (!(no_packet = av_mallocz(nb_input_files)))
         exit_program(1);
@@ -3525,14 +5397,27 @@ static int transcode(void)
     if (ret < 0)
         goto fail;
 
+    if (stage_stats_filename && !(stage_stats_file = fopen(stage_stats_filename, "w"))) {
+        ret = AVERROR(errno);
+        av_log(NULL, AV_LOG_FATAL, "Cannot open stage stats file %s: %s\n",
+               stage_stats_filename, strerror(errno));
+        goto fail;
+    }
+
+    seek_to_resume_point();
+
     if (!using_stdin) {
         av_log(NULL, AV_LOG_INFO, "Press [q] to stop, [?] for help\n");
     }
 
     timer_start = av_gettime();
 
+    if ((ret = init_input_heaps()) < 0)
+        goto fail;
+
 #if HAVE_PTHREADS
-    if ((ret = init_input_threads()) < 0)
+    if ((ret = init_input_threads()) < 0 ||
+        (ret = init_mux_threads()) < 0)
         goto fail;
 #endif
 
@@ -3557,9 +5442,20 @@ static int transcode(void)
         /* if none, if is finished */
         if (file_index < 0) {
             if (no_packet_count) {
+                int64_t start = profile_start();
                 no_packet_count = 0;
                 memset(no_packet, 0, nb_input_files);
+#if HAVE_PTHREADS
+                /* the input threads tell when there is something to read;
+                 * still wake up regularly for keyboard interaction. Either
+                 * all the inputs are read on threads or none, and a single
+                 * file input read on the main thread does not run dry. */
+                if (input_files[0]->queue)
+                    wait_input_event(100000);
+                else
+#endif
                 av_usleep(10000);
+                profile_end(&input_wait_prof, start, 0);
                 continue;
             }
             av_log(NULL, AV_LOG_VERBOSE, "No more inputs to read from, finishing.\n");
@@ -3579,8 +5475,10 @@ static int transcode(void)
 
             for (i = 0; i < input_files[file_index]->nb_streams; i++) {
                 ist = input_streams[input_files[file_index]->ist_index + i];
-                if (ist->decoding_needed)
+                if (ist->decoding_needed) {
                     output_packet(ist, NULL);
+                    update_input_heaps(ist);
+                }
             }
 
             if (opt_shortest)
@@ -3663,7 +5561,9 @@ static int transcode(void)
         }
 
         // fprintf(stderr,"read #%d.%d size=%d\n", ist->file_index, ist->st->index, pkt.size);
-        if ((ret = output_packet(ist, &pkt)) < 0 ||
+        ret = output_packet(ist, &pkt);
+        update_input_heaps(ist);
+        if (ret < 0 ||
             ((ret = poll_filters()) < 0 && ret != AVERROR_EOF)) {
             char buf[128];
             av_strerror(ret, buf, sizeof(buf));
@@ -3680,6 +5580,7 @@ static int transcode(void)
 
         /* dump report by using the output first video and audio streams */
         print_report(0, timer_start, cur_time);
+        write_stage_stats(0, timer_start, cur_time);
     }
 #if HAVE_PTHREADS
     free_input_threads();
@@ -3694,17 +5595,27 @@ static int transcode(void)
     }
     poll_filters();
     flush_encoders();
+#if HAVE_PTHREADS
+    free_pipeline_stages();
+    if (free_mux_threads(0) < 0)
+        exit_program(1);
+#endif
 
     term_exit();
 
     /* write the trailer if needed and close file */
     for (i = 0; i < nb_output_files; i++) {
         os = output_files[i]->ctx;
-        av_write_trailer(os);
+        if ((ret = av_write_trailer(os)) < 0) {
+            print_error(os->filename, ret);
+            exit_program(1);
+        }
     }
 
     /* dump report by using the first video and audio streams */
-    print_report(1, timer_start, av_gettime());
+    end_time = av_gettime();
+    print_report(1, timer_start, end_time);
+    write_stage_stats(1, timer_start, end_time);
 
     /* close each encoder */
     for (i = 0; i < nb_output_streams; i++) {
@@ -3730,6 +5641,9 @@ static int transcode(void)
     av_freep(&no_packet);
 #if HAVE_PTHREADS
     free_input_threads();
+    free_pipeline_stages();
+    free_encode_chunks();
+    free_mux_threads(1);
 #endif
 
     if (output_streams) {
@@ -3745,6 +5659,11 @@ static int transcode(void)
                 av_freep(&ost->st->codec->subtitle_header);
                 av_free(ost->forced_kf_pts);
                 av_dict_free(&ost->opts);
+#if HAVE_PTHREADS
+                free_codec_context(&ost->chunk_template);
+                av_dict_free(&ost->chunk_opts);
+                av_freep(&ost->chunks);
+#endif
             }
         }
     }
@@ -4335,7 +6254,10 @@ static int opt_input_file(OptionsContext *o, const char *opt, const char *filena
         find_codec_or_die(audio_codec_name   , AVMEDIA_TYPE_AUDIO   , 0)->id : CODEC_ID_NONE;
     ic->subtitle_codec_id= subtitle_codec_name ?
         find_codec_or_die(subtitle_codec_name, AVMEDIA_TYPE_SUBTITLE, 0)->id : CODEC_ID_NONE;
-    ic->flags |= AVFMT_FLAG_NONBLOCK;
+    /* devices are always read on an input thread, where they can block
+     * in the driver until the next packet is captured */
+    if (!HAVE_PTHREADS || !file_iformat || !(file_iformat->flags & AVFMT_NOFILE))
+        ic->flags |= AVFMT_FLAG_NONBLOCK;
     ic->interrupt_callback = int_cb;
 
     /* open the input file with generic avformat function */
@@ -4392,6 +6314,10 @@ static int opt_input_file(OptionsContext *o, const char *opt, const char *filena
     input_files[nb_input_files - 1]->ts_offset  = o->input_ts_offset - (copy_ts ? 0 : timestamp);
     input_files[nb_input_files - 1]->nb_streams = ic->nb_streams;
     input_files[nb_input_files - 1]->rate_emu   = o->rate_emu;
+#if HAVE_PTHREADS
+    input_files[nb_input_files - 1]->queue_size      = o->thread_queue_size;
+    input_files[nb_input_files - 1]->queue_max_bytes = o->thread_queue_bytes;
+#endif
 
     for (i = 0; i < o->nb_dump_attachment; i++) {
         int j;
@@ -5196,6 +7122,9 @@ loop_end:
         oc->duration = o->recording_time;
     output_files[nb_output_files - 1]->start_time     = o->start_time;
     output_files[nb_output_files - 1]->limit_filesize = o->limit_filesize;
+#if HAVE_PTHREADS
+    output_files[nb_output_files - 1]->mux_queue_size = o->mux_queue_size;
+#endif
     av_dict_copy(&output_files[nb_output_files - 1]->opts, format_opts, 0);
 
     /* check filename in case of an image number is expected */
@@ -5786,12 +7715,15 @@ static const OptionDef options[] = {
       "add timings for benchmarking" },
     { "benchmark_all", OPT_BOOL | OPT_EXPERT, {(void*)&do_benchmark_all},
       "add timings for each task" },
+    { "stage_stats_file", HAS_ARG | OPT_STRING | OPT_EXPERT, {(void*)&stage_stats_filename}, "write the time spent in each stage of the transcoding to file as JSON lines", "file" },
     { "timelimit", HAS_ARG, {(void*)opt_timelimit}, "set max runtime in seconds", "limit" },
     { "dump", OPT_BOOL | OPT_EXPERT, {(void*)&do_pkt_dump},
       "dump each input packet" },
     { "hex", OPT_BOOL | OPT_EXPERT, {(void*)&do_hex_dump},
       "when dumping packets, also dump the payload" },
     { "re", OPT_BOOL | OPT_EXPERT | OPT_OFFSET, {.off = OFFSET(rate_emu)}, "read input at native frame rate", "" },
+    { "thread_queue_size", HAS_ARG | OPT_INT | OPT_EXPERT | OPT_OFFSET, {.off = OFFSET(thread_queue_size)}, "set the maximum number of queued packets from the demuxer", "packets" },
+    { "thread_queue_bytes", HAS_ARG | OPT_INT | OPT_EXPERT | OPT_OFFSET, {.off = OFFSET(thread_queue_bytes)}, "set the maximum size of the queued packets from the demuxer", "bytes" },
     { "target", HAS_ARG | OPT_FUNC2, {(void*)opt_target}, "specify target file type (\"vcd\", \"svcd\", \"dvd\", \"dv\", \"dv50\", \"pal-vcd\", \"ntsc-svcd\", ...)", "type" },
     { "vsync", HAS_ARG | OPT_EXPERT, {(void*)opt_vsync}, "video sync method", "" },
     { "async", HAS_ARG | OPT_INT | OPT_EXPERT, {(void*)&audio_sync_method}, "audio sync method", "" },
@@ -5802,6 +7734,9 @@ static const OptionDef options[] = {
     { "dts_delta_threshold", HAS_ARG | OPT_FLOAT | OPT_EXPERT, {(void*)&dts_delta_threshold}, "timestamp discontinuity delta threshold", "threshold" },
     { "dts_error_threshold", HAS_ARG | OPT_FLOAT | OPT_EXPERT, {(void*)&dts_error_threshold}, "timestamp error delta threshold", "threshold" },
     { "xerror", OPT_BOOL, {(void*)&exit_on_error}, "exit on error", "error" },
+    { "chunk_threads", HAS_ARG | OPT_INT | OPT_EXPERT, {(void*)&chunk_threads}, "encode the segments of video streams split with -force_key_frames segment independently on this many threads", "count" },
+    { "chunk_frames", HAS_ARG | OPT_INT | OPT_EXPERT, {(void*)&chunk_frames}, "start a new chunk at the next GOP once this many frames are buffered for it with -chunk_threads", "frames" },
+    { "pipeline_frames", HAS_ARG | OPT_INT | OPT_EXPERT, {(void*)&pipeline_frames}, "run video decoders and encoders on their own threads, queueing up to this many frames for each", "frames" },
     { "copyinkf", OPT_BOOL | OPT_EXPERT | OPT_SPEC, {.off = OFFSET(copy_initial_nonkeyframes)}, "copy initial non-keyframes" },
     { "frames", OPT_INT64 | HAS_ARG | OPT_SPEC, {.off = OFFSET(max_frames)}, "set the number of frames to record", "number" },
     { "tag",   OPT_STRING | HAS_ARG | OPT_SPEC, {.off = OFFSET(codec_tags)}, "force codec tag/fourcc", "fourcc/tag" },
@@ -5884,6 +7819,7 @@ static const OptionDef options[] = {
 
     /* muxer options */
     { "muxdelay", OPT_FLOAT | HAS_ARG | OPT_EXPERT   | OPT_OFFSET, {.off = OFFSET(mux_max_delay)}, "set the maximum demux-decode delay", "seconds" },
+    { "mux_queue_size", HAS_ARG | OPT_INT | OPT_EXPERT | OPT_OFFSET, {.off = OFFSET(mux_queue_size)}, "mux on a separate thread, queueing up to this many packets", "packets" },
     { "muxpreload", OPT_FLOAT | HAS_ARG | OPT_EXPERT | OPT_OFFSET, {.off = OFFSET(mux_preload)},   "set the initial demux-decode delay", "seconds" },
 
     { "bsf", HAS_ARG | OPT_STRING | OPT_SPEC, {.off = OFFSET(bitstream_filters)}, "A comma-separated list of bitstream filters", "bitstream_filters" },
@@ -5920,6 +7856,12 @@ int main(int argc, char **argv)
     }
 
     avcodec_register_all();
+#if HAVE_PTHREADS
+    if (av_lockmgr_register(codec_lockmgr)) {
+        av_log(NULL, AV_LOG_FATAL, "Could not initialize the codec lock manager\n");
+        exit_program(1);
+    }
+#endif
 #if CONFIG_AVDEVICE
     avdevice_register_all();
 #endif
@@ -0,0 +1,369 @@
+/*
+ * Asynchronous read-ahead and write-behind protocol
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Access a nested URL from a background thread.
+ *
+ * The thread owns the nested URLContext. When reading, it fills a FIFO
+ * with the data following the read position, so that stalls of the
+ * underlying storage or network are absorbed by the FIFO instead of the
+ * demuxer. Seeks that land inside the data already read ahead just drop
+ * the skipped part, other seeks are handed to the thread, which discards
+ * the FIFO.
+ *
+ * When writing, the caller queues data in the FIFO and the thread writes
+ * it out, so that the muxer only waits when the FIFO is full. Seeks wait
+ * until everything queued before them is written, which keeps seek-back
+ * patching of headers in order, while the size is tracked from the queued
+ * writes without waiting. Write errors are returned by the next write,
+ * seek or close.
+ */
+
+#include <pthread.h>
+
+#include "libavutil/avstring.h"
+#include "libavutil/fifo.h"
+#include "libavutil/opt.h"
+#include "avformat.h"
+#include "url.h"
+
+/* amount of data passed to the nested URL at once */
+#define BLOCK_SIZE 65536
+
+typedef struct AsyncContext {
+    const AVClass *class;
+    int buffer_size;
+    URLContext *inner;
+    AVIOInterruptCB interrupt_callback; ///< checked by the nested URL
+    uint8_t *block;
+    int write;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond_caller;         ///< data, space or a seek result is available
+    pthread_cond_t cond_thread;         ///< data, space or a request is available
+    int thread_started;
+
+    /* all the fields below are protected by lock */
+    AVFifoBuffer *fifo;
+    int64_t pos;                        ///< position of the caller
+    int64_t size;                       ///< including the queued data, -1 if unknown
+    int eof;
+    int error;
+    int abort_request;
+    int close_request;                  ///< write out the FIFO and stop
+    int seek_request;
+    int64_t seek_pos;
+    int64_t seek_ret;
+} AsyncContext;
+
+static int async_check_interrupt(void *opaque)
+{
+    URLContext *h = opaque;
+    AsyncContext *c = h->priv_data;
+    int abort_request;
+
+    pthread_mutex_lock(&c->lock);
+    abort_request = c->abort_request;
+    pthread_mutex_unlock(&c->lock);
+
+    return abort_request || ff_check_interrupt(&h->interrupt_callback);
+}
+
+static void async_thread_seek(AsyncContext *c)
+{
+    int64_t seek_pos = c->seek_pos;
+
+    pthread_mutex_unlock(&c->lock);
+    seek_pos = ffurl_seek(c->inner, seek_pos, SEEK_SET);
+    pthread_mutex_lock(&c->lock);
+    if (seek_pos >= 0) {
+        c->pos = seek_pos;
+        if (!c->write) {
+            av_fifo_reset(c->fifo);
+            c->eof   = 0;
+            c->error = 0;
+        }
+    }
+    c->seek_ret     = seek_pos;
+    c->seek_request = 0;
+    pthread_cond_signal(&c->cond_caller);
+}
+
+static void async_thread_write(AsyncContext *c)
+{
+    int len = FFMIN(av_fifo_size(c->fifo), BLOCK_SIZE);
+
+    av_fifo_generic_read(c->fifo, c->block, len, NULL);
+    pthread_cond_signal(&c->cond_caller);
+    pthread_mutex_unlock(&c->lock);
+    len = ffurl_write(c->inner, c->block, len);
+    pthread_mutex_lock(&c->lock);
+    if (len < 0) {
+        /* the data queued behind the failed write is dropped */
+        c->error = len;
+        av_fifo_reset(c->fifo);
+        pthread_cond_signal(&c->cond_caller);
+    }
+}
+
+static void async_thread_read(AsyncContext *c)
+{
+    int len = FFMIN(av_fifo_space(c->fifo), BLOCK_SIZE);
+
+    pthread_mutex_unlock(&c->lock);
+    len = ffurl_read(c->inner, c->block, len);
+    pthread_mutex_lock(&c->lock);
+
+    /* the data read belongs to the old position if a seek came in */
+    if (c->seek_request)
+        return;
+    if (len > 0)
+        av_fifo_generic_write(c->fifo, c->block, len, NULL);
+    else if (!len || len == AVERROR_EOF)
+        c->eof = 1;
+    else
+        c->error = len;
+    pthread_cond_signal(&c->cond_caller);
+}
+
+static void *async_thread(void *arg)
+{
+    URLContext *h = arg;
+    AsyncContext *c = h->priv_data;
+
+    pthread_mutex_lock(&c->lock);
+    while (!c->abort_request) {
+        if (c->write) {
+            if (av_fifo_size(c->fifo))
+                async_thread_write(c);
+            else if (c->seek_request)
+                async_thread_seek(c);
+            else if (c->close_request)
+                break;
+            else
+                pthread_cond_wait(&c->cond_thread, &c->lock);
+        } else {
+            if (c->seek_request)
+                async_thread_seek(c);
+            else if (!c->eof && !c->error && av_fifo_space(c->fifo))
+                async_thread_read(c);
+            else
+                pthread_cond_wait(&c->cond_thread, &c->lock);
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    return NULL;
+}
+
+static int async_close(URLContext *h)
+{
+    AsyncContext *c = h->priv_data;
+    int ret = 0;
+
+    if (c->thread_started) {
+        pthread_mutex_lock(&c->lock);
+        if (c->write)
+            c->close_request = 1;
+        else
+            c->abort_request = 1;
+        pthread_cond_signal(&c->cond_thread);
+        pthread_mutex_unlock(&c->lock);
+        pthread_join(c->thread, NULL);
+        ret = c->error;
+    }
+    if (c->inner)
+        ffurl_close(c->inner);
+    av_fifo_free(c->fifo);
+    av_freep(&c->block);
+    pthread_cond_destroy(&c->cond_caller);
+    pthread_cond_destroy(&c->cond_thread);
+    pthread_mutex_destroy(&c->lock);
+
+    return ret;
+}
+
+static int async_open(URLContext *h, const char *arg, int flags)
+{
+    AsyncContext *c = h->priv_data;
+    int ret;
+
+    av_strstart(arg, "async:", &arg);
+
+    if ((flags & AVIO_FLAG_READ_WRITE) == AVIO_FLAG_READ_WRITE) {
+        av_log(h, AV_LOG_ERROR, "Reading and writing at once is not supported\n");
+        return AVERROR(ENOSYS);
+    }
+    c->write = !!(flags & AVIO_FLAG_WRITE);
+
+    /* needed by async_check_interrupt() while the nested URL is opened */
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->cond_caller, NULL);
+    pthread_cond_init(&c->cond_thread, NULL);
+
+    c->fifo  = av_fifo_alloc(c->buffer_size);
+    c->block = av_malloc(BLOCK_SIZE);
+    if (!c->fifo || !c->block) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+
+    c->interrupt_callback.callback = async_check_interrupt;
+    c->interrupt_callback.opaque   = h;
+    if ((ret = ffurl_open(&c->inner, arg, flags,
+                          &c->interrupt_callback, NULL)) < 0)
+        goto fail;
+    if (c->write && c->inner->max_packet_size) {
+        av_log(h, AV_LOG_ERROR, "Packet based outputs are not supported\n");
+        ret = AVERROR(ENOSYS);
+        goto fail;
+    }
+    h->is_streamed = c->inner->is_streamed;
+    c->size = ffurl_size(c->inner);
+    if (c->size < 0)
+        c->size = -1;
+
+    if ((ret = pthread_create(&c->thread, NULL, async_thread, h))) {
+        av_log(h, AV_LOG_ERROR, "pthread_create failed\n");
+        ret = AVERROR(ret);
+        goto fail;
+    }
+    c->thread_started = 1;
+
+    return 0;
+fail:
+    async_close(h);
+    return ret;
+}
+
+static int async_read(URLContext *h, unsigned char *buf, int size)
+{
+    AsyncContext *c = h->priv_data;
+    int ret;
+
+    pthread_mutex_lock(&c->lock);
+    while (!(ret = FFMIN(av_fifo_size(c->fifo), size))) {
+        if (c->error || c->eof) {
+            ret = c->error;
+            break;
+        }
+        pthread_cond_wait(&c->cond_caller, &c->lock);
+    }
+    if (ret > 0) {
+        av_fifo_generic_read(c->fifo, buf, ret, NULL);
+        c->pos += ret;
+        pthread_cond_signal(&c->cond_thread);
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    return ret;
+}
+
+static int async_write(URLContext *h, const unsigned char *buf, int size)
+{
+    AsyncContext *c = h->priv_data;
+    int ret;
+
+    pthread_mutex_lock(&c->lock);
+    while (!c->error && !(ret = FFMIN(av_fifo_space(c->fifo), size)))
+        pthread_cond_wait(&c->cond_caller, &c->lock);
+    if (c->error) {
+        ret = c->error;
+    } else {
+        av_fifo_generic_write(c->fifo, (void *)buf, ret, NULL);
+        c->pos += ret;
+        if (c->size >= 0)
+            c->size = FFMAX(c->size, c->pos);
+        pthread_cond_signal(&c->cond_thread);
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    return ret;
+}
+
+static int64_t async_seek(URLContext *h, int64_t pos, int whence)
+{
+    AsyncContext *c = h->priv_data;
+    int64_t ret;
+
+    pthread_mutex_lock(&c->lock);
+    if (whence == AVSEEK_SIZE) {
+        /* the size is tracked by the caller, no need to wait for writes */
+        ret = c->size >= 0 ? c->size : AVERROR(ENOSYS);
+        pthread_mutex_unlock(&c->lock);
+        return ret;
+    }
+
+    if (whence == SEEK_CUR)
+        pos += c->pos;
+    else if (whence == SEEK_END)
+        pos = c->size >= 0 ? c->size + pos : -1;
+    else if (whence != SEEK_SET)
+        pos = -1;
+
+    if (c->write && c->error) {
+        ret = c->error;
+    } else if (pos < 0) {
+        ret = AVERROR(EINVAL);
+    } else if (!c->write && pos >= c->pos && pos - c->pos <= av_fifo_size(c->fifo)) {
+        /* the target has been read ahead already */
+        av_fifo_drain(c->fifo, pos - c->pos);
+        c->pos = ret = pos;
+        pthread_cond_signal(&c->cond_thread);
+    } else {
+        c->seek_request = 1;
+        c->seek_pos     = pos;
+        pthread_cond_signal(&c->cond_thread);
+        while (c->seek_request)
+            pthread_cond_wait(&c->cond_caller, &c->lock);
+        ret = c->write && c->error ? c->error : c->seek_ret;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    return ret;
+}
+
+#define OFFSET(x) offsetof(AsyncContext, x)
+#define D AV_OPT_FLAG_DECODING_PARAM
+#define E AV_OPT_FLAG_ENCODING_PARAM
+static const AVOption options[] = {
+    { "async_buffer_size", "size of the read-ahead or write-behind buffer", OFFSET(buffer_size), AV_OPT_TYPE_INT, { .dbl = 4 << 20 }, BLOCK_SIZE, INT_MAX, D|E },
+    { NULL }
+};
+
+static const AVClass async_class = {
+    .class_name     = "async",
+    .item_name      = av_default_item_name,
+    .option         = options,
+    .version        = LIBAVUTIL_VERSION_INT,
+};
+
+URLProtocol ff_async_protocol = {
+    .name                = "async",
+    .url_open            = async_open,
+    .url_read            = async_read,
+    .url_write           = async_write,
+    .url_seek            = async_seek,
+    .url_close           = async_close,
+    .priv_data_size      = sizeof(AsyncContext),
+    .priv_data_class     = &async_class,
+};
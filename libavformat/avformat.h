@@ -1728,6 +1728,114 @@ enum CodecID av_guess_codec(AVOutputFormat *fmt, const char *short_name,
 int av_get_output_timestamp(struct AVFormatContext *s, int stream,
                             int64_t *dts, int64_t *wall);
 
+/**
+ * Description of a segment finished by the segment muxer.
+ */
+typedef struct AVSegmentStreamInfo {
+    AVRational time_base; ///< time base of the timestamps below
+    int64_t nb_packets;   ///< number of packets of the stream in the segment
+    int64_t nb_keyframes; ///< number of those packets flagged as keyframes
+    int64_t size;         ///< total size of their payload in bytes
+    int64_t min_pts;      ///< smallest pts, AV_NOPTS_VALUE if none is known
+    int64_t max_pts;      ///< largest pts, AV_NOPTS_VALUE if none is known
+    int64_t min_dts;      ///< smallest dts, AV_NOPTS_VALUE if none is known
+    int64_t max_dts;      ///< largest dts, AV_NOPTS_VALUE if none is known
+} AVSegmentStreamInfo;
+
+typedef struct AVSegmentInfo {
+    const char *filename; ///< name of the segment, not created in memory mode
+    int variant;          ///< index of the variant the segment belongs to
+    int index;            ///< segment number
+    AVRational time_base; ///< time base of start_pts and duration
+    int64_t start_pts;    ///< smallest pts of the segment
+    int64_t duration;     ///< time between start_pts and the end of the last packet
+    int64_t size;         ///< size of the segment in bytes
+    /**
+     * Statistics of every stream of the variant, indexed by the position
+     * of the stream inside the variant.
+     */
+    const AVSegmentStreamInfo *streams;
+    int nb_streams;
+    /**
+     * Byte offsets in the segment of the video keyframes.
+     */
+    const int64_t *keyframe_offsets;
+    int nb_keyframe_offsets;
+    int64_t write_time;   ///< wall-clock time spent muxing the segment, in microseconds
+} AVSegmentInfo;
+
+/**
+ * Callback invoked by the segment muxer for every finished segment, from
+ * the thread writing the segment.
+ *
+ * @param opaque the opaque pointer passed to av_segment_set_callback()
+ * @param info   description of the segment, only valid during the call
+ * @param data   in memory mode the segment data, info->size bytes long and
+ *               owned by the callback, which must free it with av_free();
+ *               NULL otherwise
+ * @return 0 on success, a negative AVERROR code to abort muxing
+ */
+typedef int (*AVSegmentCallback)(void *opaque, const AVSegmentInfo *info,
+                                 uint8_t *data);
+
+/**
+ * Do not create any file, deliver every segment to the callback instead.
+ */
+#define AV_SEGMENT_FLAG_MEMORY 0x0001
+
+/**
+ * Set the callback invoked by the segment muxer for every finished segment.
+ * Must be called before avformat_write_header().
+ *
+ * @param s      context allocated for the segment or stream_segment muxer
+ * @param cb     callback, NULL to remove it
+ * @param opaque pointer passed to cb
+ * @param flags  a combination of AV_SEGMENT_FLAG_*
+ * @return 0 on success, AVERROR(EINVAL) if s does not use the segment muxer
+ */
+int av_segment_set_callback(AVFormatContext *s, AVSegmentCallback cb,
+                            void *opaque, int flags);
+
+/**
+ * Check whether the segment muxer will start a new segment at a frame if
+ * that frame is a keyframe, so that an encoder can force a keyframe there.
+ * Must be called after avformat_write_header(). The muxer state is not
+ * modified, the caller keeps track of the split points reported so far.
+ *
+ * Split points depending on the input byte position or the segment size
+ * cannot be planned and are never reported.
+ *
+ * @param s              context of the segment or stream_segment muxer
+ * @param stream_index   index of the stream in s
+ * @param frame          ordinal of the frame among the frames of the stream
+ *                       written to the muxer, starting from 0; when resuming,
+ *                       starting from the first frame after the resume point
+ * @param pts            presentation timestamp of the frame
+ * @param splits         number of frames of the stream reported as split
+ *                       points before this one, counted like frame
+ * @param time_base      time base of pts
+ * @return 1 if a new segment is planned at the frame, 0 if not,
+ *         a negative AVERROR code on error
+ */
+int av_segment_is_split_point(AVFormatContext *s, int stream_index,
+                              int64_t frame, int64_t pts, int64_t splits,
+                              AVRational time_base);
+
+/**
+ * Get the point where an interrupted run of the segment muxer stopped, when
+ * it resumes from its journal. Reading the input from there avoids
+ * processing the finished segments again; packets preceding the point are
+ * dropped by the muxer anyway. Must be called after avformat_write_header().
+ *
+ * @param s   context of the segment or stream_segment muxer
+ * @param pts set to the timestamp of the first packet to write, in
+ *            AV_TIME_BASE, or AV_NOPTS_VALUE if unknown
+ * @param pos set to the input byte position of that packet, or -1 if unknown
+ * @return 1 if the muxer is resuming, 0 if not, a negative AVERROR code
+ *         on error
+ */
+int av_segment_get_resume_point(AVFormatContext *s, int64_t *pts, int64_t *pos);
+
 
 /**
  * @}
@@ -140,6 +140,20 @@ typedef struct {
      * This field is internal to libavformat and access from outside is not allowed.
      */
      int seek_count;
+
+    /**
+     * Size the buffer may grow to while the stream is accessed
+     * sequentially, 0 keeps the buffer at its initial size.
+     * This field is internal to libavformat and access from outside is not allowed.
+     */
+     int max_buffer_size;
+
+    /**
+     * Buffer size wanted for the current run of sequential accesses,
+     * reset on seeks.
+     * This field is internal to libavformat and access from outside is not allowed.
+     */
+     int seq_buffer_size;
 } AVIOContext;
 
 /* unbuffered I/O */
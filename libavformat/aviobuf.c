@@ -52,7 +52,11 @@ static const AVClass *ffio_url_child_class_next(const AVClass *prev)
     return prev ? NULL : &ffurl_context_class;
 }
 
+#define OFFSET(x) offsetof(AVIOContext,x)
+#define E AV_OPT_FLAG_ENCODING_PARAM
+#define D AV_OPT_FLAG_DECODING_PARAM
 static const AVOption ffio_url_options[] = {
+    { "max_buffer_size", "maximum size the I/O buffer grows to on sequential access", OFFSET(max_buffer_size), AV_OPT_TYPE_INT, {.dbl = 1 << 20}, 0, INT_MAX, D|E },
     { NULL },
 };
 
@@ -130,9 +134,32 @@ static void writeout(AVIOContext *s, const uint8_t *data, int len)
     s->pos += len;
 }
 
+/**
+ * Let the buffer of a file written in full buffers grow and, once it is
+ * larger than the default, make it end at a multiple of its size in the
+ * file so that full buffers are written as large aligned blocks.
+ * Packetized and non-seekable outputs, which are usually read while
+ * they are written, are left alone.
+ * Must only be called with an empty buffer.
+ */
+static void update_write_buffer(AVIOContext *s)
+{
+    if (!s->write_flag || !s->max_buffer_size || s->max_packet_size || !s->seekable)
+        return;
+
+    if (s->buffer_size < s->seq_buffer_size &&
+        ffio_set_buf_size(s, s->seq_buffer_size) >= 0)
+        s->checksum_ptr = s->buffer;
+    if (s->buffer_size > IO_BUFFER_SIZE)
+        s->buf_end = s->buffer + s->buffer_size - s->pos % s->buffer_size;
+}
+
 static void flush_buffer(AVIOContext *s)
 {
     if (s->buf_ptr > s->buffer) {
+        if (s->write_flag && s->buf_ptr == s->buffer + s->buffer_size &&
+            s->seq_buffer_size < s->max_buffer_size)
+            s->seq_buffer_size = FFMIN(2LL * s->seq_buffer_size, s->max_buffer_size);
         writeout(s, s->buffer, s->buf_ptr - s->buffer);
         if(s->update_checksum){
             s->checksum= s->update_checksum(s->checksum, s->checksum_ptr, s->buf_ptr - s->checksum_ptr);
@@ -140,6 +167,7 @@ static void flush_buffer(AVIOContext *s)
         }
     }
     s->buf_ptr = s->buffer;
+    update_write_buffer(s);
 }
 
 void avio_w8(AVIOContext *s, int b)
@@ -243,6 +271,10 @@ int64_t avio_seek(AVIOContext *s, int64_t offset, int whence)
             s->buf_end = s->buffer;
         s->buf_ptr = s->buffer;
         s->pos = offset;
+        if (s->write_flag)
+            update_write_buffer(s);
+        else if (s->max_buffer_size)
+            s->seq_buffer_size = IO_BUFFER_SIZE; /* shrunk on the next refill */
     }
     s->eof_reached = 0;
     return offset;
@@ -388,6 +420,7 @@ static void fill_buffer(AVIOContext *s)
     uint8_t *dst= !s->max_packet_size && s->buf_end - s->buffer < s->buffer_size ? s->buf_end : s->buffer;
     int len= s->buffer_size - (dst - s->buffer);
     int max_buffer_size = s->max_packet_size ? s->max_packet_size : IO_BUFFER_SIZE;
+    int grow = 0;
 
     /* can't fill the buffer without read_packet, just set EOF if appropiate */
     if (!s->read_packet && s->buf_ptr >= s->buf_end)
@@ -403,8 +436,19 @@ static void fill_buffer(AVIOContext *s)
         s->checksum_ptr= s->buffer;
     }
 
-    /* make buffer smaller in case it ended up large after probing */
-    if (s->read_packet && s->buffer_size > max_buffer_size) {
+    /* double the buffer each time a full buffer has been read without
+     * seeking, fewer and larger reads are cheaper for sequential input */
+    if (s->max_buffer_size && !s->max_packet_size && !s->direct) {
+        if (dst == s->buffer && s->buf_end == s->buffer + s->buffer_size &&
+            s->seq_buffer_size < s->max_buffer_size)
+            s->seq_buffer_size = FFMIN(2LL * s->seq_buffer_size, s->max_buffer_size);
+        max_buffer_size = FFMAX(s->seq_buffer_size, IO_BUFFER_SIZE);
+        grow = dst == s->buffer && s->buffer_size < max_buffer_size;
+    }
+
+    /* make buffer smaller in case it ended up large after probing or
+     * a seek, or larger for sequential reads */
+    if (s->read_packet && (s->buffer_size > max_buffer_size || grow)) {
         ffio_set_buf_size(s, max_buffer_size);
 
         s->checksum_ptr = dst = s->buffer;
@@ -693,6 +737,8 @@ int ffio_fdopen(AVIOContext **s, URLContext *h)
         (*s)->read_seek  = (int64_t (*)(void *, int, int64_t, int))h->prot->url_read_seek;
     }
     (*s)->av_class = &ffio_url_class;
+    av_opt_set_defaults(*s);
+    (*s)->seq_buffer_size = buffer_size;
     return 0;
 }
 
@@ -783,6 +829,11 @@ int avio_open2(AVIOContext **s, const char *filename, int flags,
         ffurl_close(h);
         return err;
     }
+    if (options && (err = av_opt_set_dict(*s, options)) < 0) {
+        avio_close(*s);
+        *s = NULL;
+        return err;
+    }
     return 0;
 }
 
@@ -20,6 +20,7 @@
  */
 
 #include "libavutil/avstring.h"
+#include "libavutil/opt.h"
 #include "avformat.h"
 #include <fcntl.h>
 #if HAVE_SETMODE
@@ -31,26 +32,74 @@
 #include "os_support.h"
 #include "url.h"
 
+/* amount of data written between two requests to drop it from the page cache */
+#define DROP_CACHE_SIZE (8 << 20)
 
 /* standard file protocol */
 
+typedef struct FileContext {
+    const AVClass *class;
+    int fd;
+    int drop_cache;
+    int64_t write_pos;      /* file offset after the last write or seek */
+    int64_t drop_start;     /* start of the written data that may still be cached */
+    int64_t drop_end;       /* end of the range last passed to POSIX_FADV_DONTNEED */
+} FileContext;
+
+static const AVOption file_options[] = {
+    { "drop_cache", "drop written data from the page cache", offsetof(FileContext, drop_cache), AV_OPT_TYPE_INT, { 0 }, 0, 1, AV_OPT_FLAG_ENCODING_PARAM },
+    { NULL }
+};
+
+static const AVClass file_class = {
+    .class_name = "file",
+    .item_name  = av_default_item_name,
+    .option     = file_options,
+    .version    = LIBAVUTIL_VERSION_INT,
+};
+
 static int file_read(URLContext *h, unsigned char *buf, int size)
 {
-    int fd = (intptr_t) h->priv_data;
-    int r = read(fd, buf, size);
+    FileContext *c = h->priv_data;
+    int r = read(c->fd, buf, size);
     return (-1 == r)?AVERROR(errno):r;
 }
 
+#if HAVE_POSIX_FADVISE
+/**
+ * Ask the kernel to drop what was written since the previous request.
+ * POSIX_FADV_DONTNEED only drops clean pages, but on Linux it starts the
+ * writeback of the dirty ones, so each range is passed twice: once to
+ * write it back, and once more with the next range to drop it.
+ */
+static void file_drop_cache(FileContext *c)
+{
+    if (c->write_pos < c->drop_end + DROP_CACHE_SIZE)
+        return;
+    posix_fadvise(c->fd, c->drop_start, c->write_pos - c->drop_start,
+                  POSIX_FADV_DONTNEED);
+    c->drop_start = c->drop_end;
+    c->drop_end   = c->write_pos;
+}
+#endif
+
 static int file_write(URLContext *h, const unsigned char *buf, int size)
 {
-    int fd = (intptr_t) h->priv_data;
-    int r = write(fd, buf, size);
+    FileContext *c = h->priv_data;
+    int r = write(c->fd, buf, size);
+#if HAVE_POSIX_FADVISE
+    if (c->drop_cache && r > 0) {
+        c->write_pos += r;
+        file_drop_cache(c);
+    }
+#endif
     return (-1 == r)?AVERROR(errno):r;
 }
 
 static int file_get_handle(URLContext *h)
 {
-    return (intptr_t) h->priv_data;
+    FileContext *c = h->priv_data;
+    return c->fd;
 }
 
 static int file_check(URLContext *h, int mask)
@@ -70,6 +119,7 @@ static int file_check(URLContext *h, int mask)
 
 static int file_open(URLContext *h, const char *filename, int flags)
 {
+    FileContext *c = h->priv_data;
     int access;
     int fd;
     struct stat st;
@@ -89,29 +139,48 @@ static int file_open(URLContext *h, const char *filename, int flags)
     fd = open(filename, access, 0666);
     if (fd == -1)
         return AVERROR(errno);
-    h->priv_data = (void *) (intptr_t) fd;
+    c->fd = fd;
 
     h->is_streamed = (0==fstat(fd, &st) && S_ISFIFO(st.st_mode)) ? 1 : 0;
 
+    if (c->drop_cache && (!(flags & AVIO_FLAG_WRITE) || !S_ISREG(st.st_mode)))
+        c->drop_cache = 0;
+#if !HAVE_POSIX_FADVISE
+    if (c->drop_cache) {
+        av_log(h, AV_LOG_WARNING, "drop_cache is not supported on this platform\n");
+        c->drop_cache = 0;
+    }
+#endif
+
     return 0;
 }
 
 /* XXX: use llseek */
 static int64_t file_seek(URLContext *h, int64_t pos, int whence)
 {
-    int fd = (intptr_t) h->priv_data;
+    FileContext *c = h->priv_data;
+
     if (whence == AVSEEK_SIZE) {
         struct stat st;
-        int ret = fstat(fd, &st);
+        int ret = fstat(c->fd, &st);
         return ret < 0 ? AVERROR(errno) : (S_ISFIFO(st.st_mode) ? 0 : st.st_size);
     }
-    return lseek(fd, pos, whence);
+    pos = lseek(c->fd, pos, whence);
+    if (pos >= 0)
+        c->write_pos = pos;
+    return pos;
 }
 
 static int file_close(URLContext *h)
 {
-    int fd = (intptr_t) h->priv_data;
-    return close(fd);
+    FileContext *c = h->priv_data;
+
+#if HAVE_POSIX_FADVISE
+    /* write back the tail and the patched headers, then drop everything */
+    if (c->drop_cache && !fsync(c->fd))
+        posix_fadvise(c->fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    return close(c->fd);
 }
 
 URLProtocol ff_file_protocol = {
@@ -123,6 +192,8 @@ URLProtocol ff_file_protocol = {
     .url_close           = file_close,
     .url_get_file_handle = file_get_handle,
     .url_check           = file_check,
+    .priv_data_size      = sizeof(FileContext),
+    .priv_data_class     = &file_class,
 };
 
 #endif /* CONFIG_FILE_PROTOCOL */
@@ -131,6 +202,7 @@ URLProtocol ff_file_protocol = {
 
 static int pipe_open(URLContext *h, const char *filename, int flags)
 {
+    FileContext *c = h->priv_data;
     int fd;
     char *final;
     av_strstart(filename, "pipe:", &filename);
@@ -146,7 +218,7 @@ static int pipe_open(URLContext *h, const char *filename, int flags)
 #if HAVE_SETMODE
     setmode(fd, O_BINARY);
 #endif
-    h->priv_data = (void *) (intptr_t) fd;
+    c->fd = fd;
     h->is_streamed = 1;
     return 0;
 }
@@ -158,6 +230,7 @@ URLProtocol ff_pipe_protocol = {
     .url_write           = file_write,
     .url_get_file_handle = file_get_handle,
     .url_check           = file_check,
+    .priv_data_size      = sizeof(FileContext),
 };
 
 #endif /* CONFIG_PIPE_PROTOCOL */
@@ -1,375 +1,2274 @@
-/*
- * Generic segmenter
- * Copyright (c) 2011, Luca Barbato
- *
- * This file is part of Libav.
- *
- * Libav is free software; you can redistribute it and/or
- * modify it under the terms of the GNU Lesser General Public
- * License as published by the Free Software Foundation; either
- * version 2.1 of the License, or (at your option) any later version.
- *
- * Libav is distributed in the hope that it will be useful,
- * but WITHOUT ANY WARRANTY; without even the implied warranty of
- * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
- * Lesser General Public License for more details.
- *
- * You should have received a copy of the GNU Lesser General Public
- * License along with Libav; if not, write to the Free Software
- * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
- */
-
-#include <float.h>
-
-#include "avformat.h"
-#include "internal.h"
-
-#include "libavutil/log.h"
-#include "libavutil/opt.h"
-#include "libavutil/avstring.h"
-#include "libavutil/parseutils.h"
-#include "libavutil/mathematics.h"
-
-typedef struct {
-    const AVClass *class;  /**< Class for private options. */
-    int number;
-    AVFormatContext *avf;
-    char *format;          /**< Set by a private option. */
-    char *list;            /**< Set by a private option. */
-    float time;            /**< Set by a private option. */
-    int  size;             /**< Set by a private option. */
-    int  wrap;             /**< Set by a private option. */
-    int64_t offset_time;
-    int64_t recording_time;
-    int has_video;
-    AVIOContext *pb;
-    char *valid_frames_str;    /** delimited list of valid frames to start a new segment */
-    int64_t *valid_frames; /** holds parsed valid_frames_str */
-    int64_t nb_valid_frames; /** count of valid frames */
-    int64_t next_valid_frame; /** the next frame number that is valid for starting a new segment */
-    int64_t next_valid_frame_index; /** array index of the current next_valid_frame */
-    int64_t frame_count; /** current video frame count */
-} SegmentContext;
-
-static int parse_valid_frames(void *log_ctx, int64_t **valid_frames, char *valid_frames_str, int64_t *nb_valid_frames)
-{
-    char *p;
-    int64_t i;
-    char *frame = NULL;
-    
-    i = 0;
-    for (p = (char *) valid_frames_str; *p; p++)
-        if (*p == ',')
-            i++;
-    *nb_valid_frames = (int64_t) (i+1);
-
-    *valid_frames = (int64_t *) av_realloc_f(NULL, sizeof(**valid_frames), i);
-    if (!*valid_frames) {
-        av_log(log_ctx, AV_LOG_ERROR, "Could not allocate valid frames array.\n");
-        return AVERROR(ENOMEM);
-    }
-    
-    i = 0;
-    frame = av_strtok(valid_frames_str, ",", &p);
-    while (frame) {
-        (*valid_frames)[i] = strtol(frame, NULL, 10);
-
-        if (i && (*valid_frames)[i] <= (*valid_frames)[i-1]) {
-            av_log(log_ctx, AV_LOG_ERROR,
-                    "Valid frames must be specified in ascending order without duplicate values.\n");
-            return AVERROR(EINVAL);
-        }
-
-        frame = av_strtok(NULL, ",", &p);
-        i++;
-    }
-
-    return 0;
-}
-
-static int segment_start(AVFormatContext *s)
-{
-    SegmentContext *seg = s->priv_data;
-    AVFormatContext *oc = seg->avf;
-    int err = 0;
-
-    if (seg->wrap)
-        seg->number %= seg->wrap;
-
-    if (av_get_frame_filename(oc->filename, sizeof(oc->filename),
-                              s->filename, seg->number++) < 0)
-        return AVERROR(EINVAL);
-
-    if ((err = avio_open2(&oc->pb, oc->filename, AVIO_FLAG_WRITE,
-                          &s->interrupt_callback, NULL)) < 0)
-        return err;
-
-    if (!oc->priv_data && oc->oformat->priv_data_size > 0) {
-        oc->priv_data = av_mallocz(oc->oformat->priv_data_size);
-        if (!oc->priv_data) {
-            avio_close(oc->pb);
-            return AVERROR(ENOMEM);
-        }
-        if (oc->oformat->priv_class) {
-            *(const AVClass**)oc->priv_data = oc->oformat->priv_class;
-            av_opt_set_defaults(oc->priv_data);
-        }
-    }
-
-    if ((err = oc->oformat->write_header(oc)) < 0) {
-        goto fail;
-    }
-
-    return 0;
-
-fail:
-    av_log(oc, AV_LOG_ERROR, "Failure occurred when starting segment '%s'\n",
-           oc->filename);
-    avio_close(oc->pb);
-    av_freep(&oc->priv_data);
-
-    return err;
-}
-
-static int segment_end(AVFormatContext *oc)
-{
-    int ret = 0;
-
-    if (oc->oformat->write_trailer)
-        ret = oc->oformat->write_trailer(oc);
-
-    if (ret < 0)
-        av_log(oc, AV_LOG_ERROR, "Failure occurred when ending segment '%s'\n",
-               oc->filename);
-
-    avio_close(oc->pb);
-    if (oc->oformat->priv_class)
-        av_opt_free(oc->priv_data);
-    av_freep(&oc->priv_data);
-
-    return ret;
-}
-
-static int seg_write_header(AVFormatContext *s)
-{
-    SegmentContext *seg = s->priv_data;
-    AVFormatContext *oc;
-    int ret, i;
-
-    seg->number = 0;
-    seg->offset_time = 0;
-    seg->recording_time = seg->time * 1000000;
-    seg->nb_valid_frames = 0;
-    seg->frame_count = 0;
-
-    oc = avformat_alloc_context();
-
-    if (!oc)
-        return AVERROR(ENOMEM);
-
-    if (seg->list)
-        if ((ret = avio_open2(&seg->pb, seg->list, AVIO_FLAG_WRITE,
-                              &s->interrupt_callback, NULL)) < 0)
-            goto fail;
-    
-    if (seg->valid_frames_str) {
-        if ((ret = parse_valid_frames(s, &seg->valid_frames, seg->valid_frames_str, &seg->nb_valid_frames)) < 0)
-            return ret;
-
-        if (seg->nb_valid_frames) {
-            if (seg->valid_frames[0]) {
-                seg->next_valid_frame_index = 0;
-            } else {
-                seg->next_valid_frame_index = 1;
-            }
-            seg->next_valid_frame = seg->valid_frames[seg->next_valid_frame_index];
-        }
-    }
-
-    for (i = 0; i< s->nb_streams; i++)
-        seg->has_video +=
-            (s->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO);
-
-    if (seg->has_video > 1)
-        av_log(s, AV_LOG_WARNING,
-               "More than a single video stream present, "
-               "expect issues decoding it.\n");
-
-    oc->oformat = av_guess_format(seg->format, s->filename, NULL);
-
-    if (!oc->oformat) {
-        ret = AVERROR_MUXER_NOT_FOUND;
-        goto fail;
-    }
-    if (oc->oformat->flags & AVFMT_NOFILE) {
-        av_log(s, AV_LOG_ERROR, "format %s not supported.\n",
-               oc->oformat->name);
-        ret = AVERROR(EINVAL);
-        goto fail;
-    }
-
-    seg->avf = oc;
-
-    oc->streams = s->streams;
-    oc->nb_streams = s->nb_streams;
-
-    if (av_get_frame_filename(oc->filename, sizeof(oc->filename),
-                              s->filename, seg->number++) < 0) {
-        ret = AVERROR(EINVAL);
-        goto fail;
-    }
-
-    if ((ret = avio_open2(&oc->pb, oc->filename, AVIO_FLAG_WRITE,
-                          &s->interrupt_callback, NULL)) < 0)
-        goto fail;
-
-    if ((ret = avformat_write_header(oc, NULL)) < 0) {
-        avio_close(oc->pb);
-        goto fail;
-    }
-
-    if (seg->list) {
-        avio_printf(seg->pb, "%s\n", oc->filename);
-        avio_flush(seg->pb);
-    }
-
-fail:
-    if (ret) {
-        if (oc) {
-            oc->streams = NULL;
-            oc->nb_streams = 0;
-            avformat_free_context(oc);
-        }
-        if (seg->list)
-            avio_close(seg->pb);
-    }
-    return ret;
-}
-
-static int seg_write_packet(AVFormatContext *s, AVPacket *pkt)
-{
-    SegmentContext *seg = s->priv_data;
-    AVFormatContext *oc = seg->avf;
-    AVStream *st = oc->streams[pkt->stream_index];
-    int64_t end_pts = seg->recording_time * seg->number;
-    int ret;
-    int can_split = (
-            seg->has_video
-            && st->codec->codec_type == AVMEDIA_TYPE_VIDEO
-            && pkt->flags & AV_PKT_FLAG_KEY
-    );
-
-    if (can_split && av_compare_ts(pkt->pts, st->time_base, end_pts, AV_TIME_BASE_Q) < 0)
-        can_split = 0;
-
-    if (can_split && seg->nb_valid_frames) {
-        if (seg->next_valid_frame < seg->frame_count && (seg->next_valid_frame_index + 1) < seg->nb_valid_frames) {
-            seg->next_valid_frame_index++;
-            seg->next_valid_frame = seg->valid_frames[seg->next_valid_frame_index];
-        }
-        if (seg->next_valid_frame != seg->frame_count)
-            can_split = 0;
-    }
-
-    if (can_split) {
-
-        av_log(s, AV_LOG_DEBUG, "Next segment starts at %d %"PRId64" with frame count of %"PRId64" \n",
-                       pkt->stream_index, pkt->pts, seg->frame_count);
-
-        ret = segment_end(oc);
-
-        if (!ret)
-            ret = segment_start(s);
-
-        if (ret)
-            goto fail;
-
-        if (seg->list) {
-            avio_printf(seg->pb, "%s\n", oc->filename);
-            avio_flush(seg->pb);
-            if (seg->size && !(seg->number % seg->size)) {
-                avio_close(seg->pb);
-                if ((ret = avio_open2(&seg->pb, seg->list, AVIO_FLAG_WRITE,
-                                      &s->interrupt_callback, NULL)) < 0)
-                    goto fail;
-            }
-        }
-    }
-
-    if (st->codec->codec_type == AVMEDIA_TYPE_VIDEO)
-        seg->frame_count++;
-
-    ret = oc->oformat->write_packet(oc, pkt);
-
-fail:
-    if (ret < 0) {
-        oc->streams = NULL;
-        oc->nb_streams = 0;
-        if (seg->list)
-            avio_close(seg->pb);
-        avformat_free_context(oc);
-    }
-
-    return ret;
-}
-
-static int seg_write_trailer(struct AVFormatContext *s)
-{
-    SegmentContext *seg = s->priv_data;
-    AVFormatContext *oc = seg->avf;
-    int ret = segment_end(oc);
-    if (seg->list)
-        avio_close(seg->pb);
-    oc->streams = NULL;
-    oc->nb_streams = 0;
-    avformat_free_context(oc);
-    return ret;
-}
-
-#define OFFSET(x) offsetof(SegmentContext, x)
-#define E AV_OPT_FLAG_ENCODING_PARAM
-static const AVOption options[] = {
-    { "segment_format",    "container format used for the segments",  OFFSET(format),  AV_OPT_TYPE_STRING, {.str = NULL},  0, 0,       E },
-    { "segment_time",      "segment length in seconds",               OFFSET(time),    AV_OPT_TYPE_FLOAT,  {.dbl = 2},     0, FLT_MAX, E },
-    { "segment_list",      "output the segment list",                 OFFSET(list),    AV_OPT_TYPE_STRING, {.str = NULL},  0, 0,       E },
-    { "segment_list_size", "maximum number of playlist entries",      OFFSET(size),    AV_OPT_TYPE_INT,    {.dbl = 5},     0, INT_MAX, E },
-    { "segment_wrap",      "number after which the index wraps",      OFFSET(wrap),    AV_OPT_TYPE_INT,    {.dbl = 0},     0, INT_MAX, E },
-    { "segment_valid_frames",     "set valid segment split frames",        OFFSET(valid_frames_str), AV_OPT_TYPE_STRING, {.str = NULL}, 0, 0,      E },
-    { NULL },
-};
-
-static const AVClass seg_class = {
-    .class_name = "segment muxer",
-    .item_name  = av_default_item_name,
-    .option     = options,
-    .version    = LIBAVUTIL_VERSION_INT,
-};
-
-AVOutputFormat ff_segment_muxer = {
-    .name           = "segment",
-    .long_name      = NULL_IF_CONFIG_SMALL("segment muxer"),
-    .priv_data_size = sizeof(SegmentContext),
-    .flags          = AVFMT_GLOBALHEADER | AVFMT_NOFILE,
-    .write_header   = seg_write_header,
-    .write_packet   = seg_write_packet,
-    .write_trailer  = seg_write_trailer,
-    .priv_class     = &seg_class,
-};
-
-static const AVClass sseg_class = {
-    .class_name = "stream_segment muxer",
-    .item_name  = av_default_item_name,
-    .option     = options,
-    .version    = LIBAVUTIL_VERSION_INT,
-};
-
-AVOutputFormat ff_stream_segment_muxer = {
-    .name           = "stream_segment,ssegment",
-    .long_name      = NULL_IF_CONFIG_SMALL("streaming segment muxer"),
-    .priv_data_size = sizeof(SegmentContext),
-    .flags          = AVFMT_NOFILE,
-    .write_header   = seg_write_header,
-    .write_packet   = seg_write_packet,
-    .write_trailer  = seg_write_trailer,
-    .priv_class     = &sseg_class,
-};
+/*
+ * Generic segmenter
+ * Copyright (c) 2011, Luca Barbato
+ *
+ * This file is part of Libav.
+ *
+ * Libav is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * Libav is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with Libav; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <float.h>
+#include <unistd.h>
+
+#include "avformat.h"
+#include "internal.h"
+
+#include "libavutil/log.h"
+#include "libavutil/opt.h"
+#include "libavutil/avstring.h"
+#include "libavutil/parseutils.h"
+#include "libavutil/mathematics.h"
+#include "libavutil/fifo.h"
+#include "libavutil/time.h"
+
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+typedef struct {
+    AVIOContext *pb;
+    int number;
+    char filename[1024];
+} SegmentPreopened;
+
+typedef enum {
+    LIST_TYPE_UNDEFINED = -1,
+    LIST_TYPE_FLAT = 0,
+    LIST_TYPE_CSV,
+    LIST_TYPE_M3U8,
+    LIST_TYPE_JSON,
+} ListType;
+
+typedef struct {
+    char *filename;
+    int index;
+    int64_t start_pts;     /**< in AV_TIME_BASE */
+    int64_t end_pts;       /**< in AV_TIME_BASE */
+    int64_t start_frame;
+    int64_t nb_frames;
+    int64_t size;
+    int64_t write_time;
+    AVSegmentStreamInfo *streams;
+    int nb_streams;
+    int64_t *keyframe_offsets;
+    int nb_keyframe_offsets;
+} SegmentListEntry;
+
+typedef struct {
+    char *str;             /**< Set by a private option. */
+    char *file;            /**< Set by a private option. */
+    int64_t *points;       /**< parsed from str or file, in ascending order */
+    int64_t nb_points;
+} SegmentSplitPoints;
+
+/**
+ * Per-stream state of a variant.
+ */
+typedef struct {
+    int64_t frame_count;         /**< number of frames of the stream written so far */
+    int64_t first_frame;         /**< frame_count when resuming, 0 otherwise */
+    const int64_t *valid_frames; /**< frames of the stream valid for starting a new segment */
+    int64_t nb_valid_frames;
+    int64_t frames_cursor;       /**< index of the first valid frame not yet passed */
+    int split_done;              /**< the stream reached the start of the current segment */
+} SegmentStream;
+
+struct SegmentContext;
+
+/**
+ * A group of streams segmented into its own set of files. All variants
+ * follow the same split schedule.
+ */
+typedef struct {
+    AVFormatContext *parent;     /**< the segment muxer */
+    struct SegmentContext *seg;
+    int index;
+    AVFormatContext *avf;        /**< inner muxer writing the segments */
+    char filename[1024];         /**< segment filename template */
+    char list_name[1024];
+    char journal_name[1024];
+    int resuming;                /**< dropping packets until the resume point */
+    int64_t resume_pts;          /**< pts where the interrupted run stopped, in AV_TIME_BASE */
+    int64_t resume_pos;          /**< input position where the interrupted run stopped */
+    AVIOContext *list_pb;        /**< list open for appending, if any */
+    SegmentListEntry *list_entries; /**< entries currently in the list */
+    int nb_list_entries;
+    int64_t list_sequence;       /**< number of entries dropped from the list */
+    int64_t list_target_duration; /**< EXT-X-TARGETDURATION of the m3u8 list, never lowered */
+    int list_trailer;            /**< size of the closing bracket of a json list */
+    SegmentListEntry *pending;   /**< segments being closed, published once closed */
+    int nb_pending;
+    int64_t nb_queued;           /**< number of segments handed to the I/O thread */
+    int number;
+    int cur_number;              /**< number of the segment being written */
+    int64_t time_splits;         /**< number of segment_time periods started so far */
+    int64_t first_time_splits;   /**< time_splits when muxing starts, from the journal when resuming */
+    int64_t start_frame;         /**< frame count at the start of the current segment */
+    int64_t start_pts;           /**< smallest pts of the current segment, in AV_TIME_BASE */
+    int64_t end_pts;             /**< end of the last packet of the current segment, in AV_TIME_BASE */
+    AVSegmentStreamInfo *stream_stats; /**< statistics of the current segment, per stream */
+    int64_t *keyframe_offsets;   /**< offsets of the video keyframes of the current segment */
+    int nb_keyframe_offsets;
+    unsigned int keyframe_offsets_size;
+    int64_t write_time;          /**< time spent in the inner muxer for the current segment */
+    SegmentStream *streams;      /**< state of every stream of the variant */
+    int ref_stream;              /**< stream whose keyframes start new segments, -1 if none */
+    int64_t frame_count;         /**< current frame count of the reference stream */
+    int64_t frames_cursor;       /**< index of the first valid frame not yet passed */
+    int64_t pts_cursor;          /**< index of the first valid pts not yet passed */
+    int64_t pos_cursor;          /**< index of the first valid position not yet passed */
+    int split_pending;           /**< some streams did not reach the next segment yet */
+    int64_t split_pts;           /**< pts of the first packet of the reference stream
+                                      in the next segment, in AV_TIME_BASE */
+    AVPacket *split_pkts;        /**< packets of the next segment held back */
+    int nb_split_pkts;
+    unsigned int split_pkts_size;
+#if HAVE_PTHREADS
+    pthread_t io_thread;         /**< opens and closes segments in the background */
+    pthread_mutex_t io_lock;     /**< protects the fields below */
+    pthread_cond_t io_cond;      /**< signaled whenever the fields below change */
+    int io_thread_started;
+    int io_exit;                 /**< set by the muxer to stop the I/O thread */
+    AVFifoBuffer *close_fifo;    /**< AVIOContext pointers of segments pending close */
+    int close_err;               /**< first error returned while closing a segment */
+    int64_t nb_closed;           /**< number of segments closed before any error */
+    SegmentPreopened *preopened; /**< ring of preopen segments opened ahead */
+    int preopen_start;           /**< index of the oldest entry in preopened */
+    int nb_preopened;            /**< number of entries in preopened */
+    int preopen_next;            /**< number of the next segment to open ahead */
+    int preopen_busy;            /**< the I/O thread is opening preopen_next */
+    int preopen_failed;          /**< opening ahead failed, stop trying */
+
+    pthread_t mux_thread;        /**< writes the packets of this variant */
+    pthread_mutex_t mux_lock;    /**< protects the fields below */
+    pthread_cond_t mux_cond;     /**< signaled whenever the fields below change */
+    int mux_thread_started;
+    int mux_exit;                /**< set by the muxer to stop the mux thread */
+    AVFifoBuffer *mux_fifo;      /**< packets waiting to be written */
+    int mux_err;                 /**< first error returned while writing a packet */
+#endif
+} SegmentVariant;
+
+typedef struct SegmentContext {
+    const AVClass *class;  /**< Class for private options. */
+    char *format;          /**< Set by a private option. */
+    char *list;            /**< Set by a private option. */
+    char *journal;         /**< Set by a private option. */
+    int resume;            /**< Set by a private option. */
+    ListType list_type;    /**< Set by a private option. */
+    float time;            /**< Set by a private option. */
+    int64_t max_size;      /**< Set by a private option. */
+    int  size;             /**< Set by a private option, -1 for the default of the list type. */
+    int  wrap;             /**< Set by a private option. */
+    int64_t recording_time;
+    SegmentSplitPoints valid_frames; /**< video frame ordinals valid for starting a new segment */
+    SegmentSplitPoints valid_pts;    /**< video pts valid for starting a new segment */
+    AVRational valid_pts_tb;         /**< Set by a private option. */
+    SegmentSplitPoints valid_pos;    /**< input byte positions valid for starting a new segment */
+    int ref_stream;        /**< Set by a private option. */
+    char *stream_valid_frames_str;   /**< Set by a private option. */
+    SegmentSplitPoints *stream_valid_frames; /**< valid frames of each stream, if any */
+    int async_close;       /**< Set by a private option. */
+    int async_queue_size;  /**< Set by a private option. */
+    int preopen;           /**< Set by a private option. */
+    char *variants_str;    /**< Set by a private option. */
+    int variant_threads;   /**< Set by a private option. */
+    int variant_queue_size; /**< Set by a private option. */
+    SegmentVariant *variants;
+    int nb_variants;
+    int *stream_variant;   /**< variant of each stream */
+    int *stream_index;     /**< index of each stream inside its variant */
+    AVSegmentCallback callback; /**< Set by av_segment_set_callback(). */
+    void *callback_opaque;
+    int callback_flags;
+} SegmentContext;
+
+#define SPLIT_POINT_SEPARATORS ", \t\r\n"
+
+/* maximum number of packets held back while the streams with their own
+ * split points catch up with the reference stream */
+#define MAX_SPLIT_PACKETS 1024
+
+/**
+ * Parse a list of split points separated by commas or whitespace.
+ * The values must be in strictly ascending order.
+ */
+static int parse_split_points(void *log_ctx, const char *str,
+                              int64_t **points, int64_t *nb_points)
+{
+    const char *p;
+    char *end;
+    int64_t n = 1;
+
+    for (p = str; *p; p++)
+        if (strchr(SPLIT_POINT_SEPARATORS, *p))
+            n++;
+
+    av_freep(points);
+    *nb_points = 0;
+    *points = av_realloc_f(NULL, sizeof(**points), n);
+    if (!*points) {
+        av_log(log_ctx, AV_LOG_ERROR, "Could not allocate split points array.\n");
+        return AVERROR(ENOMEM);
+    }
+
+    for (p = str; ; p = end) {
+        int64_t v;
+
+        p += strspn(p, SPLIT_POINT_SEPARATORS);
+        if (!*p)
+            break;
+
+        v = strtoll(p, &end, 10);
+        if (end == p || (*end && !strchr(SPLIT_POINT_SEPARATORS, *end))) {
+            av_log(log_ctx, AV_LOG_ERROR, "Invalid split point '%.*s'.\n",
+                   (int)strcspn(p, SPLIT_POINT_SEPARATORS), p);
+            return AVERROR(EINVAL);
+        }
+        if (*nb_points && v <= (*points)[*nb_points - 1]) {
+            av_log(log_ctx, AV_LOG_ERROR,
+                   "Split points must be specified in ascending order without duplicate values.\n");
+            return AVERROR(EINVAL);
+        }
+        (*points)[(*nb_points)++] = v;
+    }
+
+    return 0;
+}
+
+/**
+ * Read the whole file at url into a zero terminated buffer, to be freed
+ * with av_free().
+ */
+static int read_file(AVFormatContext *s, const char *url, char **buf)
+{
+    AVIOContext *pb = NULL;
+    int64_t size;
+    int ret;
+
+    *buf = NULL;
+    if ((ret = avio_open2(&pb, url, AVIO_FLAG_READ,
+                          &s->interrupt_callback, NULL)) < 0)
+        return ret;
+
+    size = avio_size(pb);
+    if (size < 0 || size >= INT_MAX) {
+        av_log(s, AV_LOG_ERROR, "Invalid size of file '%s'.\n", url);
+        ret = size < 0 ? size : AVERROR(EINVAL);
+        goto end;
+    }
+
+    if (!(*buf = av_malloc(size + 1))) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if ((ret = avio_read(pb, *buf, size)) < 0) {
+        av_freep(buf);
+        goto end;
+    }
+    (*buf)[ret] = 0;
+    ret = 0;
+
+end:
+    avio_close(pb);
+    return ret;
+}
+
+/**
+ * Read a list of split points from the file at url, in the same format as
+ * parse_split_points().
+ */
+static int load_split_points(AVFormatContext *s, const char *url,
+                             int64_t **points, int64_t *nb_points)
+{
+    char *buf;
+    int ret;
+
+    if ((ret = read_file(s, url, &buf)) < 0) {
+        av_log(s, AV_LOG_ERROR, "Could not read split points file '%s'.\n", url);
+        return ret;
+    }
+
+    ret = parse_split_points(s, buf, points, nb_points);
+    av_free(buf);
+    return ret;
+}
+
+/**
+ * Check whether value is one of the sorted points. Values must be queried in
+ * ascending order: *cursor is the index the search starts from and is moved
+ * to the first point not smaller than value.
+ */
+static int match_split_point(const int64_t *points, int64_t nb_points,
+                             int64_t *cursor, int64_t value)
+{
+    int64_t lo = *cursor, hi = nb_points;
+
+    while (lo < hi) {
+        int64_t mid = lo + ((hi - lo) >> 1);
+        if (points[mid] < value)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *cursor = lo;
+
+    return lo < nb_points && points[lo] == value;
+}
+
+/**
+ * Load the split points set through the options named name and name_file.
+ */
+static int init_split_points(AVFormatContext *s, SegmentSplitPoints *sp,
+                             const char *name)
+{
+    int ret = 0;
+
+    if (sp->str && sp->file) {
+        av_log(s, AV_LOG_ERROR, "%s and %s_file are mutually exclusive.\n",
+               name, name);
+        return AVERROR(EINVAL);
+    }
+    if (sp->str)
+        ret = parse_split_points(s, sp->str, &sp->points, &sp->nb_points);
+    else if (sp->file)
+        ret = load_split_points(s, sp->file, &sp->points, &sp->nb_points);
+
+    return ret;
+}
+
+
+/**
+ * Flush and close a finished segment, returning the first I/O error seen.
+ */
+static int segment_close_pb(AVIOContext *pb)
+{
+    int ret;
+
+    avio_flush(pb);
+    ret = pb->error;
+    if (avio_close(pb) < 0 && !ret)
+        ret = AVERROR(EIO);
+
+    return ret;
+}
+
+/**
+ * Return the path of url if it designates a local file, NULL otherwise.
+ */
+static const char *local_path(const char *url)
+{
+    av_strstart(url, "file:", &url);
+    return strchr(url, ':') ? NULL : url;
+}
+
+/**
+ * Close a segment that was opened ahead of time but never used and remove
+ * the file it created.
+ */
+static void segment_discard_preopened(AVIOContext *pb, const char *filename)
+{
+    const char *path = local_path(filename);
+
+    avio_close(pb);
+    if (path)
+        unlink(path);
+}
+
+#if HAVE_PTHREADS
+/**
+ * Open the next segment file ahead of time. Called with io_lock held.
+ */
+static void segment_preopen_next(SegmentVariant *v)
+{
+    AVFormatContext *s = v->parent;
+    SegmentPreopened *e;
+    char filename[1024];
+    AVIOContext *pb = NULL;
+    int number = v->preopen_next;
+    int ret;
+
+    v->preopen_busy = 1;
+    pthread_mutex_unlock(&v->io_lock);
+
+    if (av_get_frame_filename(filename, sizeof(filename), v->filename, number) < 0)
+        ret = AVERROR(EINVAL);
+    else
+        ret = avio_open2(&pb, filename, AVIO_FLAG_WRITE,
+                         &s->interrupt_callback, NULL);
+
+    pthread_mutex_lock(&v->io_lock);
+    v->preopen_busy = 0;
+    if (ret < 0) {
+        av_log(s, AV_LOG_WARNING,
+               "Could not open segment '%s' ahead of time, "
+               "segments will be opened on demand.\n", filename);
+        v->preopen_failed = 1;
+    } else if (number != v->preopen_next) {
+        segment_discard_preopened(pb, filename);
+    } else {
+        e = &v->preopened[(v->preopen_start + v->nb_preopened) % v->seg->preopen];
+        e->pb     = pb;
+        e->number = number;
+        av_strlcpy(e->filename, filename, sizeof(e->filename));
+        v->nb_preopened++;
+        v->preopen_next = number + 1;
+    }
+    pthread_cond_broadcast(&v->io_cond);
+}
+
+static void *segment_io_thread(void *arg)
+{
+    SegmentVariant *v = arg;
+    AVIOContext *pb;
+    int ret;
+
+    pthread_mutex_lock(&v->io_lock);
+    for (;;) {
+        int can_preopen = v->nb_preopened < v->seg->preopen &&
+                          !v->preopen_failed && !v->io_exit;
+        if (can_preopen) {
+            segment_preopen_next(v);
+            continue;
+        }
+        if (!v->close_fifo || !av_fifo_size(v->close_fifo)) {
+            if (v->io_exit)
+                break;
+            pthread_cond_wait(&v->io_cond, &v->io_lock);
+            continue;
+        }
+
+        av_fifo_generic_read(v->close_fifo, &pb, sizeof(pb), NULL);
+        pthread_cond_broadcast(&v->io_cond);
+        pthread_mutex_unlock(&v->io_lock);
+
+        ret = segment_close_pb(pb);
+
+        pthread_mutex_lock(&v->io_lock);
+        if (ret < 0 && !v->close_err)
+            v->close_err = ret;
+        else if (!v->close_err)
+            v->nb_closed++;
+    }
+    pthread_mutex_unlock(&v->io_lock);
+
+    return NULL;
+}
+#endif
+
+static int segment_async_init(SegmentVariant *v)
+{
+    SegmentContext *seg = v->seg;
+#if HAVE_PTHREADS
+    int ret;
+
+    if (!seg->async_close && !seg->preopen)
+        return 0;
+
+    if (seg->async_close &&
+        !(v->close_fifo = av_fifo_alloc(seg->async_queue_size * sizeof(AVIOContext *))))
+        return AVERROR(ENOMEM);
+    if (seg->preopen &&
+        !(v->preopened = av_mallocz(seg->preopen * sizeof(*v->preopened)))) {
+        av_fifo_free(v->close_fifo);
+        v->close_fifo = NULL;
+        return AVERROR(ENOMEM);
+    }
+
+    pthread_mutex_init(&v->io_lock, NULL);
+    pthread_cond_init(&v->io_cond, NULL);
+    v->io_exit        = 0;
+    v->close_err      = 0;
+    v->nb_closed      = 0;
+    v->preopen_start  = 0;
+    v->nb_preopened   = 0;
+    v->preopen_busy   = 0;
+    v->preopen_failed = 0;
+    v->preopen_next   = v->number;
+
+    if ((ret = pthread_create(&v->io_thread, NULL, segment_io_thread, v))) {
+        av_log(v->parent, AV_LOG_ERROR, "pthread_create failed: %s\n", strerror(ret));
+        pthread_mutex_destroy(&v->io_lock);
+        pthread_cond_destroy(&v->io_cond);
+        av_fifo_free(v->close_fifo);
+        v->close_fifo = NULL;
+        av_freep(&v->preopened);
+        return AVERROR(ret);
+    }
+    v->io_thread_started = 1;
+#else
+    if (seg->async_close || seg->preopen)
+        av_log(v->parent, AV_LOG_WARNING,
+               "Asynchronous segment I/O requires threads, "
+               "segments will be opened and closed synchronously.\n");
+#endif
+    return 0;
+}
+
+/**
+ * Wait until every pending segment is closed, stop the I/O thread and
+ * discard the segments that were opened ahead of time but not used.
+ *
+ * @return the first error returned while closing a segment
+ */
+static int segment_async_uninit(SegmentVariant *v)
+{
+    int ret = 0;
+#if HAVE_PTHREADS
+    if (!v->io_thread_started)
+        return 0;
+
+    pthread_mutex_lock(&v->io_lock);
+    v->io_exit = 1;
+    pthread_cond_broadcast(&v->io_cond);
+    pthread_mutex_unlock(&v->io_lock);
+
+    pthread_join(v->io_thread, NULL);
+    v->io_thread_started = 0;
+    ret = v->close_err;
+
+    for (; v->nb_preopened; v->nb_preopened--) {
+        SegmentPreopened *e = &v->preopened[v->preopen_start];
+        segment_discard_preopened(e->pb, e->filename);
+        v->preopen_start = (v->preopen_start + 1) % v->seg->preopen;
+    }
+
+    pthread_mutex_destroy(&v->io_lock);
+    pthread_cond_destroy(&v->io_cond);
+    av_fifo_free(v->close_fifo);
+    v->close_fifo = NULL;
+    av_freep(&v->preopened);
+#endif
+    return ret;
+}
+
+/**
+ * Hand a finished segment over to the I/O thread, or close it right away
+ * if asynchronous closing is disabled. Blocks while the queue is full.
+ *
+ * @return 1 if the segment was queued, 0 if it was closed, a negative
+ *         AVERROR code on error
+ */
+static int segment_queue_close(SegmentVariant *v, AVIOContext *pb)
+{
+#if HAVE_PTHREADS
+    int ret;
+
+    if (v->close_fifo) {
+        pthread_mutex_lock(&v->io_lock);
+        while (av_fifo_space(v->close_fifo) < sizeof(pb) && !v->close_err)
+            pthread_cond_wait(&v->io_cond, &v->io_lock);
+        if (!(ret = v->close_err)) {
+            av_fifo_generic_write(v->close_fifo, &pb, sizeof(pb), NULL);
+            pthread_cond_broadcast(&v->io_cond);
+        }
+        pthread_mutex_unlock(&v->io_lock);
+        if (ret < 0) {
+            segment_close_pb(pb);
+            return ret;
+        }
+        v->nb_queued++;
+        return 1;
+    }
+#endif
+    return segment_close_pb(pb);
+}
+
+/**
+ * Return the number of segments the I/O thread closed successfully.
+ */
+static int64_t segment_nb_closed(SegmentVariant *v)
+{
+    int64_t nb_closed = 0;
+#if HAVE_PTHREADS
+    if (!v->io_thread_started)
+        return v->nb_closed;
+
+    pthread_mutex_lock(&v->io_lock);
+    nb_closed = v->nb_closed;
+    pthread_mutex_unlock(&v->io_lock);
+#endif
+    return nb_closed;
+}
+
+static void segment_stats_reset(SegmentVariant *v)
+{
+    int i;
+
+    for (i = 0; i < v->avf->nb_streams; i++) {
+        AVSegmentStreamInfo *st = &v->stream_stats[i];
+        memset(st, 0, sizeof(*st));
+        st->time_base = v->avf->streams[i]->time_base;
+        st->min_pts   = st->max_pts = AV_NOPTS_VALUE;
+        st->min_dts   = st->max_dts = AV_NOPTS_VALUE;
+    }
+    v->nb_keyframe_offsets = 0;
+    v->write_time          = 0;
+}
+
+static void stats_update_ts(int64_t ts, int64_t *min, int64_t *max)
+{
+    if (ts == AV_NOPTS_VALUE)
+        return;
+    if (*min == AV_NOPTS_VALUE || ts < *min)
+        *min = ts;
+    if (*max == AV_NOPTS_VALUE || ts > *max)
+        *max = ts;
+}
+
+/**
+ * Account pkt, about to be written at the current position of the segment,
+ * in the statistics of the current segment.
+ */
+static int segment_stats_update(SegmentVariant *v, const AVPacket *pkt)
+{
+    AVSegmentStreamInfo *st = &v->stream_stats[pkt->stream_index];
+    int key = pkt->flags & AV_PKT_FLAG_KEY;
+
+    /* the first segment is opened before its header sets the time base */
+    st->time_base = v->avf->streams[pkt->stream_index]->time_base;
+    st->nb_packets++;
+    st->nb_keyframes += !!key;
+    st->size         += pkt->size;
+    stats_update_ts(pkt->pts, &st->min_pts, &st->max_pts);
+    stats_update_ts(pkt->dts, &st->min_dts, &st->max_dts);
+
+    if (key && v->avf->streams[pkt->stream_index]->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
+        int64_t *offsets = av_fast_realloc(v->keyframe_offsets, &v->keyframe_offsets_size,
+                                           (v->nb_keyframe_offsets + 1) * sizeof(*offsets));
+        if (!offsets)
+            return AVERROR(ENOMEM);
+        v->keyframe_offsets = offsets;
+        offsets[v->nb_keyframe_offsets++] = avio_tell(v->avf->pb);
+    }
+
+    return 0;
+}
+
+/**
+ * Open the output of the segment numbered v->number, taking it from the
+ * pool of segments opened ahead of time when possible.
+ */
+static int segment_open(SegmentVariant *v)
+{
+    AVFormatContext *s = v->parent;
+    AVFormatContext *oc = v->avf;
+    int number = v->number++;
+
+    v->cur_number  = number;
+    v->start_frame = v->frame_count;
+    v->start_pts  = AV_NOPTS_VALUE;
+    v->end_pts    = AV_NOPTS_VALUE;
+    segment_stats_reset(v);
+
+    if (v->seg->callback_flags & AV_SEGMENT_FLAG_MEMORY) {
+        if (av_get_frame_filename(oc->filename, sizeof(oc->filename),
+                                  v->filename, number) < 0)
+            av_strlcpy(oc->filename, v->filename, sizeof(oc->filename));
+        return avio_open_dyn_buf(&oc->pb);
+    }
+
+#if HAVE_PTHREADS
+    if (v->preopened) {
+        oc->pb = NULL;
+
+        pthread_mutex_lock(&v->io_lock);
+        while (v->preopen_busy && v->preopen_next == number)
+            pthread_cond_wait(&v->io_cond, &v->io_lock);
+        if (v->nb_preopened && v->preopened[v->preopen_start].number == number) {
+            SegmentPreopened *e = &v->preopened[v->preopen_start];
+            av_strlcpy(oc->filename, e->filename, sizeof(oc->filename));
+            oc->pb = e->pb;
+            v->preopen_start = (v->preopen_start + 1) % v->seg->preopen;
+            v->nb_preopened--;
+        } else {
+            for (; v->nb_preopened; v->nb_preopened--) {
+                SegmentPreopened *e = &v->preopened[v->preopen_start];
+                segment_discard_preopened(e->pb, e->filename);
+                v->preopen_start = (v->preopen_start + 1) % v->seg->preopen;
+            }
+            v->preopen_next = number + 1;
+        }
+        pthread_cond_broadcast(&v->io_cond);
+        pthread_mutex_unlock(&v->io_lock);
+
+        if (oc->pb)
+            return 0;
+    }
+#endif
+
+    if (av_get_frame_filename(oc->filename, sizeof(oc->filename),
+                              v->filename, number) < 0)
+        return AVERROR(EINVAL);
+
+    return avio_open2(&oc->pb, oc->filename, AVIO_FLAG_WRITE,
+                      &s->interrupt_callback, NULL);
+}
+
+static void list_print_json_string(AVIOContext *pb, const char *str)
+{
+    avio_w8(pb, '"');
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            avio_printf(pb, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            avio_printf(pb, "\\u%04x", (unsigned char)*str);
+        else
+            avio_w8(pb, *str);
+    }
+    avio_w8(pb, '"');
+}
+
+static void list_print_json_ts(AVIOContext *pb, const char *name, int64_t ts)
+{
+    if (ts == AV_NOPTS_VALUE)
+        avio_printf(pb, ", \"%s\": null", name);
+    else
+        avio_printf(pb, ", \"%s\": %"PRId64, name, ts);
+}
+
+static void list_print_entry(SegmentVariant *v, AVIOContext *pb,
+                             const SegmentListEntry *e, int first)
+{
+    double start = e->start_pts / (double)AV_TIME_BASE;
+    double end   = e->end_pts   / (double)AV_TIME_BASE;
+    int64_t nb_packets = 0;
+    int i;
+
+    for (i = 0; i < e->nb_streams; i++)
+        nb_packets += e->streams[i].nb_packets;
+
+    switch (v->seg->list_type) {
+    case LIST_TYPE_FLAT:
+        avio_printf(pb, "%s\n", e->filename);
+        break;
+    case LIST_TYPE_CSV:
+        avio_printf(pb, "%s,%d,%f,%f,%"PRId64",%"PRId64",%"PRId64",%"PRId64",%d,%f\n",
+                    e->filename, e->index, start, end, e->start_frame,
+                    e->start_frame + e->nb_frames - 1, e->size, nb_packets,
+                    e->nb_keyframe_offsets, e->write_time / 1000000.0);
+        break;
+    case LIST_TYPE_M3U8:
+        avio_printf(pb, "#EXTINF:%f,\n%s\n", end - start, e->filename);
+        break;
+    case LIST_TYPE_JSON:
+        avio_printf(pb, "%s    { \"filename\": ", first ? "" : ",\n");
+        list_print_json_string(pb, e->filename);
+        avio_printf(pb, ", \"index\": %d, \"start_time\": %f, \"end_time\": %f, "
+                    "\"start_frame\": %"PRId64", \"end_frame\": %"PRId64", "
+                    "\"size\": %"PRId64", \"packets\": %"PRId64", \"write_time\": %f,\n"
+                    "      \"keyframe_offsets\": [",
+                    e->index, start, end, e->start_frame,
+                    e->start_frame + e->nb_frames - 1, e->size, nb_packets,
+                    e->write_time / 1000000.0);
+        for (i = 0; i < e->nb_keyframe_offsets; i++)
+            avio_printf(pb, "%s%"PRId64, i ? ", " : "", e->keyframe_offsets[i]);
+        avio_printf(pb, "],\n      \"streams\": [");
+        for (i = 0; i < e->nb_streams; i++) {
+            const AVSegmentStreamInfo *st = &e->streams[i];
+            avio_printf(pb, "%s\n        { \"index\": %d, \"time_base\": \"%d/%d\", "
+                        "\"packets\": %"PRId64", \"keyframes\": %"PRId64", "
+                        "\"size\": %"PRId64,
+                        i ? "," : "", i, st->time_base.num, st->time_base.den,
+                        st->nb_packets, st->nb_keyframes, st->size);
+            list_print_json_ts(pb, "min_pts", st->min_pts);
+            list_print_json_ts(pb, "max_pts", st->max_pts);
+            list_print_json_ts(pb, "min_dts", st->min_dts);
+            list_print_json_ts(pb, "max_dts", st->max_dts);
+            avio_printf(pb, " }");
+        }
+        avio_printf(pb, " ] }");
+        break;
+    }
+}
+
+/**
+ * Open a temporary file to replace the file name with, see
+ * replace_file_commit(). Files that are not local are written in place.
+ */
+static int replace_file_open(AVFormatContext *s, AVIOContext **pb,
+                             const char *name, char *tmp_name, int tmp_size)
+{
+    int ret;
+
+    snprintf(tmp_name, tmp_size, "%s%s", name, local_path(name) ? ".tmp" : "");
+    if ((ret = avio_open2(pb, tmp_name, AVIO_FLAG_WRITE,
+                          &s->interrupt_callback, NULL)) < 0)
+        av_log(s, AV_LOG_ERROR, "Could not open '%s'\n", tmp_name);
+    return ret;
+}
+
+/**
+ * Flush the temporary file opened by replace_file_open() and rename it over
+ * name, so that readers never see a partially written file. pb is left open.
+ */
+static int replace_file_commit(AVFormatContext *s, AVIOContext *pb,
+                               const char *name, const char *tmp_name)
+{
+    const char *path = local_path(name);
+
+    avio_flush(pb);
+    if (pb->error < 0)
+        return pb->error;
+
+    if (path && rename(local_path(tmp_name), path) < 0) {
+        int ret = AVERROR(errno);
+        av_log(s, AV_LOG_ERROR, "Could not rename '%s' to '%s'\n", tmp_name, path);
+        return ret;
+    }
+
+    return 0;
+}
+
+/**
+ * EXT-X-TARGETDURATION needed for an entry: its duration rounded up to
+ * whole seconds.
+ */
+static int64_t list_entry_target_duration(const SegmentListEntry *e)
+{
+    return FFMAX(1, (e->end_pts - e->start_pts + AV_TIME_BASE - 1) / AV_TIME_BASE);
+}
+
+/**
+ * Write every entry of the list to a temporary file and rename it over the
+ * list, so that readers never see a partial list. Lists that are not local
+ * files are overwritten in place. The file stays open for appending the
+ * next entries, see segment_list_add().
+ *
+ * @param final set when no entry will be added anymore
+ */
+static int segment_list_rewrite(SegmentVariant *v, int final)
+{
+    AVFormatContext *s = v->parent;
+    SegmentContext *seg = v->seg;
+    char tmp_name[1024 + 4];
+    AVIOContext *pb = NULL;
+    int ret, i;
+
+    avio_close(v->list_pb);
+    v->list_pb = NULL;
+
+    if ((ret = replace_file_open(s, &pb, v->list_name, tmp_name, sizeof(tmp_name))) < 0)
+        return ret;
+
+    if (seg->list_type == LIST_TYPE_M3U8) {
+        /* the target duration must not change between versions of the
+         * playlist, it is only raised when a segment is longer than it */
+        for (i = 0; i < v->nb_list_entries; i++)
+            v->list_target_duration = FFMAX(v->list_target_duration,
+                                            list_entry_target_duration(&v->list_entries[i]));
+        avio_printf(pb, "#EXTM3U\n#EXT-X-VERSION:3\n"
+                    "#EXT-X-TARGETDURATION:%"PRId64"\n"
+                    "#EXT-X-MEDIA-SEQUENCE:%"PRId64"\n",
+                    v->list_target_duration, v->list_sequence);
+    } else if (seg->list_type == LIST_TYPE_JSON) {
+        avio_printf(pb, "[\n");
+    }
+
+    for (i = 0; i < v->nb_list_entries; i++)
+        list_print_entry(v, pb, &v->list_entries[i], !i);
+
+    if (seg->list_type == LIST_TYPE_M3U8 && final) {
+        avio_printf(pb, "#EXT-X-ENDLIST\n");
+    } else if (seg->list_type == LIST_TYPE_JSON) {
+        v->list_trailer = v->nb_list_entries ? 3 : 2;
+        avio_printf(pb, "%s]\n", v->nb_list_entries ? "\n" : "");
+    }
+
+    if ((ret = replace_file_commit(s, pb, v->list_name, tmp_name)) < 0) {
+        avio_close(pb);
+        return ret;
+    }
+
+    /* the renamed file stays open for appending the next entries, json
+     * lists are appended to by writing over their closing bracket */
+    if (!final && (seg->list_type != LIST_TYPE_JSON || pb->seekable))
+        v->list_pb = pb;
+    else
+        avio_close(pb);
+
+    return 0;
+}
+
+static void list_entry_free(SegmentListEntry *e)
+{
+    av_freep(&e->filename);
+    av_freep(&e->streams);
+    av_freep(&e->keyframe_offsets);
+}
+
+/**
+ * Append a copy of e to the array of entries, without writing it.
+ */
+static int list_entry_append(SegmentListEntry **entries, int *nb_entries,
+                             const SegmentListEntry *e)
+{
+    SegmentListEntry *entry;
+
+    entry = av_realloc(*entries, (*nb_entries + 1) * sizeof(**entries));
+    if (!entry)
+        return AVERROR(ENOMEM);
+    *entries = entry;
+    entry   += *nb_entries;
+    *entry = *e;
+    entry->filename         = av_strdup(e->filename);
+    entry->streams          = av_malloc(e->nb_streams * sizeof(*e->streams));
+    entry->keyframe_offsets = av_malloc(e->nb_keyframe_offsets * sizeof(*e->keyframe_offsets));
+    if (!entry->filename ||
+        (e->nb_streams && !entry->streams) ||
+        (e->nb_keyframe_offsets && !entry->keyframe_offsets)) {
+        list_entry_free(entry);
+        return AVERROR(ENOMEM);
+    }
+    if (e->nb_streams)
+        memcpy(entry->streams, e->streams, e->nb_streams * sizeof(*e->streams));
+    if (e->nb_keyframe_offsets)
+        memcpy(entry->keyframe_offsets, e->keyframe_offsets,
+               e->nb_keyframe_offsets * sizeof(*e->keyframe_offsets));
+    (*nb_entries)++;
+
+    return 0;
+}
+
+/**
+ * Add an entry to the list of the variant. The entry is appended to the
+ * open list, which is only rewritten when it is not open yet, when its
+ * window slides or when the m3u8 target duration has to be raised.
+ */
+static int segment_list_add(SegmentVariant *v, const SegmentListEntry *e)
+{
+    SegmentContext *seg = v->seg;
+    int ret, rewrite = !v->list_pb;
+
+    if (!seg->list)
+        return 0;
+
+    if (seg->size && v->nb_list_entries >= seg->size) {
+        /* flat lists restart from scratch, the others slide */
+        int drop = seg->list_type == LIST_TYPE_FLAT ? v->nb_list_entries : 1;
+        int i;
+
+        for (i = 0; i < drop; i++)
+            list_entry_free(&v->list_entries[i]);
+        memmove(v->list_entries, v->list_entries + drop,
+                (v->nb_list_entries - drop) * sizeof(*v->list_entries));
+        v->nb_list_entries -= drop;
+        v->list_sequence   += drop;
+        rewrite = 1;
+    }
+
+    if (seg->list_type == LIST_TYPE_M3U8 &&
+        list_entry_target_duration(e) > v->list_target_duration) {
+        if (v->list_pb)
+            av_log(v->parent, AV_LOG_WARNING, "Segment '%s' is longer than the "
+                   "target duration %"PRId64" of the playlist, raising it.\n",
+                   e->filename, v->list_target_duration);
+        rewrite = 1;
+    }
+
+    if ((ret = list_entry_append(&v->list_entries, &v->nb_list_entries, e)) < 0)
+        return ret;
+
+    if (rewrite)
+        return segment_list_rewrite(v, 0);
+
+    if (seg->list_type == LIST_TYPE_JSON) {
+        int64_t pos = avio_seek(v->list_pb, -v->list_trailer, SEEK_CUR);
+        if (pos < 0)
+            return pos;
+        list_print_entry(v, v->list_pb, e, v->nb_list_entries == 1);
+        v->list_trailer = 3;
+        avio_printf(v->list_pb, "\n]\n");
+    } else {
+        list_print_entry(v, v->list_pb, e, 0);
+    }
+    avio_flush(v->list_pb);
+    return v->list_pb->error;
+}
+
+/**
+ * Complete the list once the last entry was added.
+ */
+static int segment_list_close(SegmentVariant *v)
+{
+    int ret;
+
+    if (v->seg->list_type != LIST_TYPE_M3U8)
+        return 0;
+    if (!v->list_pb)
+        return segment_list_rewrite(v, 1);
+
+    avio_printf(v->list_pb, "#EXT-X-ENDLIST\n");
+    avio_flush(v->list_pb);
+    ret = v->list_pb->error;
+    avio_close(v->list_pb);
+    v->list_pb = NULL;
+    return ret;
+}
+
+static void segment_list_free(SegmentVariant *v)
+{
+    int i;
+
+    avio_close(v->list_pb);
+    v->list_pb = NULL;
+    for (i = 0; i < v->nb_list_entries; i++)
+        list_entry_free(&v->list_entries[i]);
+    av_freep(&v->list_entries);
+    v->nb_list_entries = 0;
+    for (i = 0; i < v->nb_pending; i++)
+        list_entry_free(&v->pending[i]);
+    av_freep(&v->pending);
+    v->nb_pending = 0;
+}
+
+/**
+ * Add the segment that was just started to a flat list.
+ */
+static int segment_list_add_flat(SegmentVariant *v)
+{
+    SegmentListEntry e = { v->avf->filename };
+
+    if (v->seg->list_type != LIST_TYPE_FLAT)
+        return 0;
+
+    return segment_list_add(v, &e);
+}
+
+/**
+ * Announce a finished and closed segment in the list and to the callback.
+ * Unknown timestamps are AV_NOPTS_VALUE in e.
+ */
+static int segment_publish(SegmentVariant *v, const SegmentListEntry *e,
+                           uint8_t *data)
+{
+    SegmentContext *seg = v->seg;
+    AVSegmentInfo info = { 0 };
+    int ret = 0;
+
+    if (seg->list_type != LIST_TYPE_FLAT) {
+        SegmentListEntry le = *e;
+        if (le.start_pts == AV_NOPTS_VALUE)
+            le.start_pts = le.end_pts = 0;
+        ret = segment_list_add(v, &le);
+    }
+
+    if (ret < 0 || !seg->callback) {
+        av_free(data);
+        return ret;
+    }
+
+    info.filename            = e->filename;
+    info.variant             = v->index;
+    info.index               = e->index;
+    info.time_base           = AV_TIME_BASE_Q;
+    info.start_pts           = e->start_pts;
+    if (e->start_pts != AV_NOPTS_VALUE)
+        info.duration        = e->end_pts - e->start_pts;
+    info.size                = e->size;
+    info.write_time          = e->write_time;
+    info.streams             = e->streams;
+    info.nb_streams          = e->nb_streams;
+    info.keyframe_offsets    = e->keyframe_offsets;
+    info.nb_keyframe_offsets = e->nb_keyframe_offsets;
+
+    return seg->callback(seg->callback_opaque, &info, data);
+}
+
+/**
+ * Publish the segments handed to the I/O thread that it has closed since
+ * the last call, in order.
+ */
+static int segment_publish_closed(SegmentVariant *v)
+{
+    int64_t nb_closed;
+    int ret;
+
+    if (!v->nb_pending)
+        return 0;
+
+    nb_closed = segment_nb_closed(v);
+    while (v->nb_pending && v->nb_queued - v->nb_pending < nb_closed) {
+        ret = segment_publish(v, &v->pending[0], NULL);
+        list_entry_free(&v->pending[0]);
+        memmove(v->pending, v->pending + 1, --v->nb_pending * sizeof(*v->pending));
+        if (ret < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+/**
+ * Record the state of the variant at the start of the segment being
+ * written, pkt being its first packet, so that an interrupted run can
+ * resume from there.
+ */
+static int segment_journal_write(SegmentVariant *v, const AVPacket *pkt)
+{
+    AVFormatContext *s = v->parent;
+    AVStream *st = v->avf->streams[pkt->stream_index];
+    char tmp_name[1024 + 4];
+    AVIOContext *pb = NULL;
+    int ret, i;
+
+    if (!v->seg->journal)
+        return 0;
+
+    if ((ret = replace_file_open(s, &pb, v->journal_name, tmp_name, sizeof(tmp_name))) < 0)
+        return ret;
+
+    avio_printf(pb, "number %d\n", v->cur_number);
+    avio_printf(pb, "time_splits %"PRId64"\n", v->time_splits);
+    avio_printf(pb, "frames %"PRId64"\n", v->frame_count);
+    avio_printf(pb, "stream_frames");
+    for (i = 0; i < v->avf->nb_streams; i++)
+        avio_printf(pb, " %"PRId64, v->streams[i].frame_count);
+    avio_printf(pb, "\npts %"PRId64"\n", pkt->pts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE :
+                av_rescale_q(pkt->pts, st->time_base, AV_TIME_BASE_Q));
+    avio_printf(pb, "pos %"PRId64"\n", pkt->pos);
+    avio_printf(pb, "list_sequence %"PRId64"\n", v->list_sequence);
+    avio_printf(pb, "list_target_duration %"PRId64"\n", v->list_target_duration);
+    for (i = 0; i < v->nb_list_entries; i++) {
+        const SegmentListEntry *e = &v->list_entries[i];
+        avio_printf(pb, "entry %d %"PRId64" %"PRId64" %"PRId64" %"PRId64" %"PRId64" %s\n",
+                    e->index, e->start_pts, e->end_pts, e->start_frame,
+                    e->nb_frames, e->size, e->filename);
+    }
+
+    ret = replace_file_commit(s, pb, v->journal_name, tmp_name);
+    avio_close(pb);
+    return ret;
+}
+
+/**
+ * Restore the state recorded by segment_journal_write(), if any.
+ */
+static int segment_journal_read(SegmentVariant *v)
+{
+    AVFormatContext *s = v->parent;
+    char *buf, *line, *next, *p;
+    int ret = 0, n, i, has_number = 0;
+
+    if ((ret = read_file(s, v->journal_name, &buf)) < 0) {
+        if (ret != AVERROR(ENOENT))
+            return ret;
+        av_log(s, AV_LOG_INFO, "No journal '%s', starting from the beginning.\n",
+               v->journal_name);
+        return 0;
+    }
+
+    v->resume_pts = AV_NOPTS_VALUE;
+    v->resume_pos = -1;
+
+    for (line = buf; *line; line = next) {
+        SegmentListEntry e = { 0 };
+
+        next = line + strcspn(line, "\n");
+        if (*next)
+            *next++ = 0;
+
+        if (sscanf(line, "number %d", &v->number) == 1) {
+            has_number = 1;
+        } else if (sscanf(line, "time_splits %"SCNd64, &v->time_splits) == 1 ||
+                   sscanf(line, "frames %"SCNd64, &v->frame_count) == 1 ||
+                   sscanf(line, "pts %"SCNd64, &v->resume_pts) == 1 ||
+                   sscanf(line, "pos %"SCNd64, &v->resume_pos) == 1 ||
+                   sscanf(line, "list_sequence %"SCNd64, &v->list_sequence) == 1 ||
+                   sscanf(line, "list_target_duration %"SCNd64, &v->list_target_duration) == 1) {
+        } else if (av_strstart(line, "stream_frames", (const char **)&p)) {
+            for (i = 0; i < v->avf->nb_streams; i++)
+                v->streams[i].frame_count =
+                v->streams[i].first_frame = strtoll(p, &p, 10);
+        } else if (sscanf(line, "entry %d %"SCNd64" %"SCNd64" %"SCNd64" %"SCNd64" %"SCNd64" %n",
+                          &e.index, &e.start_pts, &e.end_pts, &e.start_frame,
+                          &e.nb_frames, &e.size, &n) == 6) {
+            e.filename = line + n;
+            if ((ret = list_entry_append(&v->list_entries, &v->nb_list_entries, &e)) < 0)
+                goto end;
+        } else if (*line) {
+            av_log(s, AV_LOG_WARNING, "Ignoring journal line '%s'.\n", line);
+        }
+    }
+
+    if (!has_number || (v->resume_pts == AV_NOPTS_VALUE && v->resume_pos < 0)) {
+        av_log(s, AV_LOG_ERROR, "Journal '%s' has no resume point.\n", v->journal_name);
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+
+    v->resuming = 1;
+    av_log(s, AV_LOG_INFO, "Resuming variant %d at segment %d.\n", v->index, v->number);
+
+end:
+    av_free(buf);
+    return ret;
+}
+
+/**
+ * Check whether pkt is the first packet of the segment an interrupted run
+ * was writing.
+ */
+static int segment_resume_reached(SegmentVariant *v, const AVPacket *pkt)
+{
+    AVStream *st = v->avf->streams[pkt->stream_index];
+
+    if (pkt->stream_index != v->ref_stream || !(pkt->flags & AV_PKT_FLAG_KEY))
+        return 0;
+    if (v->resume_pts != AV_NOPTS_VALUE && pkt->pts != AV_NOPTS_VALUE)
+        return av_rescale_q(pkt->pts, st->time_base, AV_TIME_BASE_Q) >= v->resume_pts;
+    return v->resume_pos >= 0 && pkt->pos >= v->resume_pos;
+}
+
+static int segment_start(SegmentVariant *v)
+{
+    SegmentContext *seg = v->seg;
+    AVFormatContext *oc = v->avf;
+    int err = 0;
+
+    if (seg->wrap)
+        v->number %= seg->wrap;
+
+    if ((err = segment_open(v)) < 0)
+        return err;
+
+    if (!oc->priv_data && oc->oformat->priv_data_size > 0) {
+        oc->priv_data = av_mallocz(oc->oformat->priv_data_size);
+        if (!oc->priv_data) {
+            avio_close(oc->pb);
+            return AVERROR(ENOMEM);
+        }
+        if (oc->oformat->priv_class) {
+            *(const AVClass**)oc->priv_data = oc->oformat->priv_class;
+            av_opt_set_defaults(oc->priv_data);
+        }
+    }
+
+    v->write_time -= av_gettime();
+    err = oc->oformat->write_header(oc);
+    v->write_time += av_gettime();
+    if (err < 0)
+        goto fail;
+
+    return 0;
+
+fail:
+    av_log(oc, AV_LOG_ERROR, "Failure occurred when starting segment '%s'\n",
+           oc->filename);
+    avio_close(oc->pb);
+    av_freep(&oc->priv_data);
+
+    return err;
+}
+
+static int segment_end(SegmentVariant *v)
+{
+    SegmentContext *seg = v->seg;
+    AVFormatContext *oc = v->avf;
+    SegmentListEntry e = { oc->filename, v->cur_number, v->start_pts, v->end_pts,
+                           v->start_frame, v->frame_count - v->start_frame, 0, 0,
+                           v->stream_stats, oc->nb_streams,
+                           v->keyframe_offsets, v->nb_keyframe_offsets };
+    uint8_t *data = NULL;
+    int ret = 0, err;
+
+    v->write_time -= av_gettime();
+    if (oc->oformat->write_trailer)
+        ret = oc->oformat->write_trailer(oc);
+    v->write_time += av_gettime();
+
+    if (ret < 0)
+        av_log(oc, AV_LOG_ERROR, "Failure occurred when ending segment '%s'\n",
+               oc->filename);
+
+    if (seg->callback_flags & AV_SEGMENT_FLAG_MEMORY) {
+        e.size = avio_close_dyn_buf(oc->pb, &data);
+        err = 0;
+    } else {
+        e.size = avio_tell(oc->pb);
+        err = segment_queue_close(v, oc->pb);
+    }
+    oc->pb = NULL;
+    if (err < 0 && !ret) {
+        av_log(oc, AV_LOG_ERROR, "Failure occurred when closing segment '%s'\n",
+               oc->filename);
+        ret = err;
+    }
+
+    e.write_time = v->write_time;
+
+    if (ret < 0)
+        av_freep(&data);
+    else if (err > 0)
+        /* published by segment_publish_closed() once the segment is closed */
+        ret = list_entry_append(&v->pending, &v->nb_pending, &e);
+    else
+        ret = segment_publish(v, &e, data);
+    if (oc->oformat->priv_class)
+        av_opt_free(oc->priv_data);
+    av_freep(&oc->priv_data);
+
+    return ret;
+}
+
+/**
+ * Account and write pkt into the current segment.
+ */
+static int variant_mux_packet(SegmentVariant *v, AVPacket *pkt)
+{
+    AVFormatContext *oc = v->avf;
+    AVStream *st = oc->streams[pkt->stream_index];
+    int ret;
+
+    v->streams[pkt->stream_index].frame_count++;
+    if (pkt->stream_index == v->ref_stream)
+        v->frame_count++;
+
+    if (pkt->pts != AV_NOPTS_VALUE) {
+        int64_t pts = av_rescale_q(pkt->pts, st->time_base, AV_TIME_BASE_Q);
+        int64_t end = av_rescale_q(pkt->pts + pkt->duration, st->time_base, AV_TIME_BASE_Q);
+        if (v->start_pts == AV_NOPTS_VALUE || pts < v->start_pts)
+            v->start_pts = pts;
+        if (v->end_pts == AV_NOPTS_VALUE || end > v->end_pts)
+            v->end_pts = end;
+    }
+
+    if ((ret = segment_stats_update(v, pkt)) < 0)
+        return ret;
+
+    v->write_time -= av_gettime();
+    ret = oc->oformat->write_packet(oc, pkt);
+    v->write_time += av_gettime();
+
+    return ret;
+}
+
+/**
+ * End the current segment and start the next one, pkt being its first
+ * packet.
+ */
+static int variant_split(SegmentVariant *v, const AVPacket *pkt)
+{
+    int ret;
+
+    if ((ret = segment_end(v)) < 0 ||
+        (ret = segment_start(v)) < 0 ||
+        (ret = segment_journal_write(v, pkt)) < 0)
+        return ret;
+
+    return segment_list_add_flat(v);
+}
+
+/**
+ * Mark the reference stream packet pkt as the first one of the next
+ * segment. The streams with their own split points reach the next segment
+ * at their first split point from the timestamp of pkt on.
+ *
+ * @return 1 if every stream reached the next segment, 0 otherwise
+ */
+static int variant_split_begin(SegmentVariant *v, const AVPacket *pkt)
+{
+    AVStream *st = v->avf->streams[pkt->stream_index];
+    int i, done = 1;
+
+    v->split_pts = av_rescale_q(pkt->pts, st->time_base, AV_TIME_BASE_Q);
+    for (i = 0; i < v->avf->nb_streams; i++) {
+        SegmentStream *vs = &v->streams[i];
+        vs->split_done = !vs->valid_frames || i == v->ref_stream ||
+                         v->split_pts == AV_NOPTS_VALUE;
+        done &= vs->split_done;
+    }
+
+    return done;
+}
+
+/**
+ * Check whether pkt, of a stream with its own split points, is the first
+ * packet of that stream in the next segment.
+ */
+static int variant_split_reached(SegmentVariant *v, const AVPacket *pkt)
+{
+    AVStream *st = v->avf->streams[pkt->stream_index];
+    SegmentStream *vs = &v->streams[pkt->stream_index];
+
+    return pkt->pts != AV_NOPTS_VALUE &&
+           av_rescale_q(pkt->pts, st->time_base, AV_TIME_BASE_Q) >= v->split_pts &&
+           match_split_point(vs->valid_frames, vs->nb_valid_frames,
+                             &vs->frames_cursor, vs->frame_count);
+}
+
+/**
+ * Start the next segment with the packets held back for it.
+ */
+static int variant_split_complete(SegmentVariant *v)
+{
+    int ret, i;
+
+    for (i = 0; i < v->avf->nb_streams; i++)
+        v->streams[i].split_done = 1;
+    v->split_pending = 0;
+
+    ret = variant_split(v, &v->split_pkts[0]);
+    for (i = 0; i < v->nb_split_pkts; i++) {
+        if (!ret)
+            ret = variant_mux_packet(v, &v->split_pkts[i]);
+        av_free_packet(&v->split_pkts[i]);
+    }
+    v->nb_split_pkts = 0;
+
+    return ret;
+}
+
+/**
+ * Hold pkt back until every stream reached the next segment.
+ */
+static int variant_split_hold(SegmentVariant *v, AVPacket *pkt)
+{
+    AVPacket *pkts, *q;
+    int ret, i;
+
+    pkts = av_fast_realloc(v->split_pkts, &v->split_pkts_size,
+                           (v->nb_split_pkts + 1) * sizeof(*pkts));
+    if (!pkts)
+        return AVERROR(ENOMEM);
+    v->split_pkts = pkts;
+    q = &pkts[v->nb_split_pkts];
+    *q = *pkt;
+    q->destruct = NULL;          // copy the data, the caller still owns it
+    if ((ret = av_dup_packet(q)) < 0)
+        return ret;
+    v->nb_split_pkts++;
+
+    for (i = 0; i < v->avf->nb_streams; i++)
+        if (!v->streams[i].split_done)
+            break;
+    if (i < v->avf->nb_streams) {
+        if (v->nb_split_pkts < MAX_SPLIT_PACKETS)
+            return 0;
+        av_log(v->parent, AV_LOG_WARNING,
+               "Stream #%d of variant %d did not reach a split point in time, "
+               "starting the next segment anyway.\n", i, v->index);
+    }
+
+    return variant_split_complete(v);
+}
+
+/**
+ * Start a new segment if pkt is a valid split point, then write pkt.
+ * pkt->stream_index is the index of the stream inside the variant.
+ */
+static int variant_write_packet(SegmentVariant *v, AVPacket *pkt)
+{
+    SegmentContext *seg = v->seg;
+    AVFormatContext *oc = v->avf;
+    AVStream *st = oc->streams[pkt->stream_index];
+    SegmentStream *vs = &v->streams[pkt->stream_index];
+    int64_t end_pts = seg->recording_time * v->time_splits;
+    int ret, time_reached = 0;
+    int can_split = (
+            pkt->stream_index == v->ref_stream
+            && pkt->flags & AV_PKT_FLAG_KEY
+    );
+
+    if ((ret = segment_publish_closed(v)) < 0)
+        return ret;
+
+    if (v->resuming) {
+        /* drop what the interrupted run already wrote */
+        if (!segment_resume_reached(v, pkt))
+            return 0;
+        v->resuming = 0;
+        can_split   = 0;
+        variant_split_begin(v, pkt);
+    }
+
+    if (!vs->split_done) {
+        /* the packets preceding the split point of the stream belong to the
+         * previous segment, which the interrupted run wrote if resuming */
+        if (!variant_split_reached(v, pkt))
+            return v->split_pending ? variant_mux_packet(v, pkt) : 0;
+        vs->split_done = 1;
+    }
+
+    if (v->split_pending)
+        return variant_split_hold(v, pkt);
+
+    if (can_split) {
+        time_reached = av_compare_ts(pkt->pts, st->time_base, end_pts, AV_TIME_BASE_Q) >= 0;
+        if (!time_reached &&
+            !(seg->max_size && avio_tell(oc->pb) >= seg->max_size))
+            can_split = 0;
+    }
+
+    /* the first frame always belongs to the first segment */
+    if (can_split && !v->frame_count)
+        can_split = 0;
+
+    if (can_split && seg->valid_frames.points &&
+        !match_split_point(seg->valid_frames.points, seg->valid_frames.nb_points,
+                           &v->frames_cursor, v->frame_count))
+        can_split = 0;
+
+    if (can_split && vs->valid_frames &&
+        !match_split_point(vs->valid_frames, vs->nb_valid_frames,
+                           &vs->frames_cursor, vs->frame_count))
+        can_split = 0;
+
+    if (can_split && seg->valid_pts.points) {
+        AVRational tb = seg->valid_pts_tb.num ? seg->valid_pts_tb : st->time_base;
+        if (pkt->pts == AV_NOPTS_VALUE ||
+            !match_split_point(seg->valid_pts.points, seg->valid_pts.nb_points,
+                               &v->pts_cursor,
+                               av_rescale_q(pkt->pts, st->time_base, tb)))
+            can_split = 0;
+    }
+
+    if (can_split && seg->valid_pos.points &&
+        (pkt->pos < 0 ||
+         !match_split_point(seg->valid_pos.points, seg->valid_pos.nb_points,
+                            &v->pos_cursor, pkt->pos)))
+        can_split = 0;
+
+    if (can_split) {
+
+        av_log(v->parent, AV_LOG_DEBUG, "Next segment of variant %d starts at %d %"PRId64" with frame count of %"PRId64" \n",
+               v->index, pkt->stream_index, pkt->pts, v->frame_count);
+
+        v->time_splits += time_reached;
+
+        if (!variant_split_begin(v, pkt)) {
+            v->split_pending = 1;
+            return variant_split_hold(v, pkt);
+        }
+        if ((ret = variant_split(v, pkt)) < 0)
+            return ret;
+    }
+
+    return variant_mux_packet(v, pkt);
+}
+
+#if HAVE_PTHREADS
+static void *variant_mux_thread(void *arg)
+{
+    SegmentVariant *v = arg;
+    AVPacket pkt;
+    int ret = 0;
+
+    pthread_mutex_lock(&v->mux_lock);
+    for (;;) {
+        while (!av_fifo_size(v->mux_fifo) && !v->mux_exit)
+            pthread_cond_wait(&v->mux_cond, &v->mux_lock);
+        if (!av_fifo_size(v->mux_fifo))
+            break;
+
+        av_fifo_generic_read(v->mux_fifo, &pkt, sizeof(pkt), NULL);
+        pthread_cond_broadcast(&v->mux_cond);
+        pthread_mutex_unlock(&v->mux_lock);
+
+        if (ret >= 0)
+            ret = variant_write_packet(v, &pkt);
+        av_free_packet(&pkt);
+
+        pthread_mutex_lock(&v->mux_lock);
+        if (ret < 0 && !v->mux_err) {
+            v->mux_err = ret;
+            pthread_cond_broadcast(&v->mux_cond);
+        }
+    }
+    pthread_mutex_unlock(&v->mux_lock);
+
+    return NULL;
+}
+
+/**
+ * Hand pkt over to the mux thread of the variant as its stream stream_index,
+ * taking ownership of its data. Blocks while the queue is full.
+ */
+static int variant_queue_packet(SegmentVariant *v, AVPacket *pkt,
+                                int stream_index)
+{
+    AVPacket q = *pkt;
+    int ret;
+
+    q.stream_index = stream_index;
+    pkt->destruct = NULL;            // do not free original but only the copy
+    if ((ret = av_dup_packet(&q)) < 0)
+        return ret;
+
+    pthread_mutex_lock(&v->mux_lock);
+    while (av_fifo_space(v->mux_fifo) < sizeof(q) && !v->mux_err)
+        pthread_cond_wait(&v->mux_cond, &v->mux_lock);
+    if (!(ret = v->mux_err)) {
+        av_fifo_generic_write(v->mux_fifo, &q, sizeof(q), NULL);
+        pthread_cond_broadcast(&v->mux_cond);
+    }
+    pthread_mutex_unlock(&v->mux_lock);
+
+    if (ret < 0)
+        av_free_packet(&q);
+    return ret;
+}
+#endif
+
+static int variant_mux_init(SegmentVariant *v)
+{
+#if HAVE_PTHREADS
+    SegmentContext *seg = v->seg;
+    int ret;
+
+    if (!seg->variant_threads)
+        return 0;
+
+    if (!(v->mux_fifo = av_fifo_alloc(seg->variant_queue_size * sizeof(AVPacket))))
+        return AVERROR(ENOMEM);
+
+    pthread_mutex_init(&v->mux_lock, NULL);
+    pthread_cond_init(&v->mux_cond, NULL);
+    v->mux_exit = 0;
+    v->mux_err  = 0;
+
+    if ((ret = pthread_create(&v->mux_thread, NULL, variant_mux_thread, v))) {
+        av_log(v->parent, AV_LOG_ERROR, "pthread_create failed: %s\n", strerror(ret));
+        pthread_mutex_destroy(&v->mux_lock);
+        pthread_cond_destroy(&v->mux_cond);
+        av_fifo_free(v->mux_fifo);
+        v->mux_fifo = NULL;
+        return AVERROR(ret);
+    }
+    v->mux_thread_started = 1;
+#else
+    if (v->seg->variant_threads && !v->index)
+        av_log(v->parent, AV_LOG_WARNING,
+               "Variant threads require threads support, "
+               "variants will be written synchronously.\n");
+#endif
+    return 0;
+}
+
+/**
+ * Write every queued packet and stop the mux thread.
+ *
+ * @return the first error returned while writing a packet
+ */
+static int variant_mux_uninit(SegmentVariant *v)
+{
+    int ret = 0;
+#if HAVE_PTHREADS
+    AVPacket pkt;
+
+    if (!v->mux_thread_started)
+        return 0;
+
+    pthread_mutex_lock(&v->mux_lock);
+    v->mux_exit = 1;
+    pthread_cond_broadcast(&v->mux_cond);
+    pthread_mutex_unlock(&v->mux_lock);
+
+    pthread_join(v->mux_thread, NULL);
+    v->mux_thread_started = 0;
+    ret = v->mux_err;
+
+    while (av_fifo_size(v->mux_fifo)) {
+        av_fifo_generic_read(v->mux_fifo, &pkt, sizeof(pkt), NULL);
+        av_free_packet(&pkt);
+    }
+
+    pthread_mutex_destroy(&v->mux_lock);
+    pthread_cond_destroy(&v->mux_cond);
+    av_fifo_free(v->mux_fifo);
+    v->mux_fifo = NULL;
+#endif
+    return ret;
+}
+
+/**
+ * Copy template to buf, replacing each "%v" with the variant index.
+ */
+static int variant_filename(char *buf, int buf_size, const char *template,
+                            int index)
+{
+    const char *p;
+    int len = 0;
+
+    for (p = template; *p && len < buf_size; p++) {
+        if (p[0] == '%' && p[1] == 'v') {
+            len += snprintf(buf + len, buf_size - len, "%d", index);
+            p++;
+        } else {
+            if (p[0] == '%' && p[1] == '%' && len + 1 < buf_size)
+                buf[len++] = *p++;
+            buf[len++] = *p;
+        }
+    }
+    if (len >= buf_size)
+        return AVERROR(EINVAL);
+    buf[len] = 0;
+
+    return 0;
+}
+
+/**
+ * Parse the per-stream split points, given as a '|' separated list of
+ * index:frames items.
+ */
+static int parse_stream_valid_frames(AVFormatContext *s)
+{
+    SegmentContext *seg = s->priv_data;
+    const char *p = seg->stream_valid_frames_str;
+    char *end, *frames;
+    int ret;
+
+    if (!p)
+        return 0;
+
+    if (!(seg->stream_valid_frames = av_mallocz(s->nb_streams *
+                                                sizeof(*seg->stream_valid_frames))))
+        return AVERROR(ENOMEM);
+
+    for (; *p; p = *end ? end + 1 : end) {
+        long idx = strtol(p, &end, 10);
+        SegmentSplitPoints *sp;
+
+        if (end == p || *end != ':' || idx < 0 || idx >= s->nb_streams) {
+            av_log(s, AV_LOG_ERROR, "Invalid stream in segment_stream_valid_frames '%s'.\n",
+                   seg->stream_valid_frames_str);
+            return AVERROR(EINVAL);
+        }
+        sp = &seg->stream_valid_frames[idx];
+        if (sp->points) {
+            av_log(s, AV_LOG_ERROR, "Split points of stream %ld given twice.\n", idx);
+            return AVERROR(EINVAL);
+        }
+        p   = end + 1;
+        end = (char *)p + strcspn(p, "|");
+        if (!(frames = av_malloc(end - p + 1)))
+            return AVERROR(ENOMEM);
+        av_strlcpy(frames, p, end - p + 1);
+        ret = parse_split_points(s, frames, &sp->points, &sp->nb_points);
+        av_free(frames);
+        if (ret < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+/**
+ * Assign every stream to a variant according to the segment_variants option,
+ * a space separated list of variants, each one a comma separated list of
+ * stream indexes.
+ */
+static int parse_variants(AVFormatContext *s)
+{
+    SegmentContext *seg = s->priv_data;
+    const char *p = seg->variants_str;
+    char *end;
+    int i;
+
+    seg->stream_variant = av_malloc(s->nb_streams * sizeof(*seg->stream_variant));
+    seg->stream_index   = av_malloc(s->nb_streams * sizeof(*seg->stream_index));
+    if (!seg->stream_variant || !seg->stream_index)
+        return AVERROR(ENOMEM);
+
+    seg->nb_variants = 1;
+    for (i = 0; i < s->nb_streams; i++) {
+        seg->stream_variant[i] = p ? -1 : 0;
+        seg->stream_index[i]   = i;
+    }
+    if (!p)
+        return 0;
+
+    seg->nb_variants = 0;
+    for (;;) {
+        int nb_streams = 0;
+
+        p += strspn(p, " ");
+        if (!*p)
+            break;
+        do {
+            long idx = strtol(p, &end, 10);
+            if (end == p || idx < 0 || idx >= s->nb_streams) {
+                av_log(s, AV_LOG_ERROR, "Invalid stream index in variant %d.\n",
+                       seg->nb_variants);
+                return AVERROR(EINVAL);
+            }
+            if (seg->stream_variant[idx] >= 0) {
+                av_log(s, AV_LOG_ERROR, "Stream %ld is part of more than one variant.\n",
+                       idx);
+                return AVERROR(EINVAL);
+            }
+            seg->stream_variant[idx] = seg->nb_variants;
+            seg->stream_index[idx]   = nb_streams++;
+            p = end;
+        } while (*p == ',' && p++);
+        if (*p && *p != ' ') {
+            av_log(s, AV_LOG_ERROR, "Invalid variant list '%s'.\n", seg->variants_str);
+            return AVERROR(EINVAL);
+        }
+        seg->nb_variants++;
+    }
+
+    for (i = 0; i < s->nb_streams; i++) {
+        if (seg->stream_variant[i] < 0) {
+            av_log(s, AV_LOG_ERROR, "Stream %d is not part of any variant.\n", i);
+            return AVERROR(EINVAL);
+        }
+    }
+    if (!seg->nb_variants) {
+        av_log(s, AV_LOG_ERROR, "No variant specified.\n");
+        return AVERROR(EINVAL);
+    }
+    if (seg->nb_variants > 1 &&
+        (!strstr(s->filename, "%v") || (seg->list && !strstr(seg->list, "%v")) ||
+         (seg->journal && !strstr(seg->journal, "%v")))) {
+        av_log(s, AV_LOG_ERROR,
+               "The segment filename, list and journal names must contain %%v "
+               "when there is more than one variant.\n");
+        return AVERROR(EINVAL);
+    }
+
+    return 0;
+}
+
+static int variant_init(SegmentVariant *v)
+{
+    AVFormatContext *s = v->parent;
+    SegmentContext *seg = v->seg;
+    AVFormatContext *oc;
+    int ret, i;
+
+    if ((ret = variant_filename(v->filename, sizeof(v->filename),
+                                s->filename, v->index)) < 0)
+        return ret;
+
+    if (!(oc = v->avf = avformat_alloc_context()))
+        return AVERROR(ENOMEM);
+
+    oc->oformat = av_guess_format(seg->format, v->filename, NULL);
+    if (!oc->oformat)
+        return AVERROR_MUXER_NOT_FOUND;
+    if (oc->oformat->flags & AVFMT_NOFILE) {
+        av_log(s, AV_LOG_ERROR, "format %s not supported.\n",
+               oc->oformat->name);
+        return AVERROR(EINVAL);
+    }
+
+    v->ref_stream  = -1;
+    v->time_splits = 1;
+    /* time split segments last segment_time, up to the next keyframe */
+    v->list_target_duration = FFMAX(1, (seg->recording_time + AV_TIME_BASE - 1) / AV_TIME_BASE);
+    for (i = 0; i < s->nb_streams; i++) {
+        SegmentStream *vs;
+
+        if (seg->stream_variant[i] != v->index)
+            continue;
+        if (!(oc->streams = av_realloc_f(oc->streams, oc->nb_streams + 1,
+                                         sizeof(*oc->streams))) ||
+            !(v->streams = av_realloc_f(v->streams, oc->nb_streams + 1,
+                                        sizeof(*v->streams))))
+            return AVERROR(ENOMEM);
+        vs = &v->streams[oc->nb_streams];
+        memset(vs, 0, sizeof(*vs));
+        vs->split_done = 1;
+        if (seg->stream_valid_frames) {
+            vs->valid_frames    = seg->stream_valid_frames[i].points;
+            vs->nb_valid_frames = seg->stream_valid_frames[i].nb_points;
+        }
+        if (i == seg->ref_stream ||
+            (v->ref_stream < 0 &&
+             s->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO))
+            v->ref_stream = oc->nb_streams;
+        oc->streams[oc->nb_streams++] = s->streams[i];
+    }
+
+    if (v->ref_stream >= 0)
+        av_log(s, AV_LOG_VERBOSE, "Variant %d is split on the keyframes of stream #%d.\n",
+               v->index, v->ref_stream);
+
+    if (seg->list &&
+        (ret = variant_filename(v->list_name, sizeof(v->list_name),
+                                seg->list, v->index)) < 0)
+        return ret;
+
+    if (seg->journal) {
+        if ((ret = variant_filename(v->journal_name, sizeof(v->journal_name),
+                                    seg->journal, v->index)) < 0)
+            return ret;
+        if (seg->resume && (ret = segment_journal_read(v)) < 0)
+            return ret;
+    }
+    v->first_time_splits = v->time_splits;
+
+    if (!(v->stream_stats = av_malloc(oc->nb_streams * sizeof(*v->stream_stats))))
+        return AVERROR(ENOMEM);
+
+    if ((ret = segment_async_init(v)) < 0)
+        return ret;
+
+    if ((ret = segment_open(v)) < 0)
+        return ret;
+
+    v->write_time -= av_gettime();
+    ret = avformat_write_header(oc, NULL);
+    v->write_time += av_gettime();
+    if (ret < 0) {
+        avio_close(oc->pb);
+        oc->pb = NULL;
+        return ret;
+    }
+
+    if ((ret = segment_list_add_flat(v)) < 0)
+        return ret;
+
+    return variant_mux_init(v);
+}
+
+static void seg_free(AVFormatContext *s)
+{
+    SegmentContext *seg = s->priv_data;
+    int i, j;
+
+    for (i = 0; i < seg->nb_variants; i++) {
+        SegmentVariant *v = &seg->variants[i];
+
+        variant_mux_uninit(v);
+        segment_async_uninit(v);
+        segment_list_free(v);
+        for (j = 0; j < v->nb_split_pkts; j++)
+            av_free_packet(&v->split_pkts[j]);
+        av_freep(&v->split_pkts);
+        av_freep(&v->stream_stats);
+        av_freep(&v->keyframe_offsets);
+        av_freep(&v->streams);
+        if (v->avf) {
+            avio_close(v->avf->pb);
+            av_freep(&v->avf->streams);
+            v->avf->nb_streams = 0;
+            avformat_free_context(v->avf);
+        }
+    }
+    av_freep(&seg->variants);
+    seg->nb_variants = 0;
+    av_freep(&seg->stream_variant);
+    av_freep(&seg->stream_index);
+    av_freep(&seg->valid_frames.points);
+    av_freep(&seg->valid_pts.points);
+    av_freep(&seg->valid_pos.points);
+    if (seg->stream_valid_frames)
+        for (i = 0; i < s->nb_streams; i++)
+            av_freep(&seg->stream_valid_frames[i].points);
+    av_freep(&seg->stream_valid_frames);
+}
+
+static int seg_write_header(AVFormatContext *s)
+{
+    SegmentContext *seg = s->priv_data;
+    int ret, i;
+
+    seg->recording_time = seg->time * 1000000;
+
+    if (seg->list && seg->list_type == LIST_TYPE_UNDEFINED) {
+        if      (av_match_ext(seg->list, "csv"))  seg->list_type = LIST_TYPE_CSV;
+        else if (av_match_ext(seg->list, "m3u8")) seg->list_type = LIST_TYPE_M3U8;
+        else if (av_match_ext(seg->list, "json")) seg->list_type = LIST_TYPE_JSON;
+        else                                      seg->list_type = LIST_TYPE_FLAT;
+    }
+    if (seg->size < 0)
+        seg->size = seg->list_type == LIST_TYPE_FLAT ? 5 : 0;
+
+    if ((ret = init_split_points(s, &seg->valid_frames, "segment_valid_frames")) < 0 ||
+        (ret = init_split_points(s, &seg->valid_pts,    "segment_valid_pts"))    < 0 ||
+        (ret = init_split_points(s, &seg->valid_pos,    "segment_valid_pos"))    < 0)
+        goto fail;
+
+    if (seg->callback_flags & AV_SEGMENT_FLAG_MEMORY) {
+        if (seg->async_close || seg->preopen)
+            av_log(s, AV_LOG_WARNING,
+                   "Segments are kept in memory, "
+                   "ignoring asynchronous segment I/O.\n");
+        seg->async_close = 0;
+        seg->preopen     = 0;
+    }
+
+    if (seg->journal && seg->async_close) {
+        av_log(s, AV_LOG_WARNING,
+               "The journal must only record closed segments, "
+               "segments will be closed synchronously.\n");
+        seg->async_close = 0;
+    }
+
+    if (seg->wrap && seg->preopen) {
+        av_log(s, AV_LOG_WARNING,
+               "Segments cannot be opened ahead of time when the index wraps, "
+               "they would overwrite the oldest segments early.\n");
+        seg->preopen = 0;
+    }
+
+    if (seg->ref_stream >= 0 &&
+        (seg->ref_stream >= s->nb_streams ||
+         s->streams[seg->ref_stream]->codec->codec_type != AVMEDIA_TYPE_VIDEO)) {
+        av_log(s, AV_LOG_ERROR, "Reference stream %d is not a video stream.\n",
+               seg->ref_stream);
+        ret = AVERROR(EINVAL);
+        goto fail;
+    }
+
+    if ((ret = parse_stream_valid_frames(s)) < 0 ||
+        (ret = parse_variants(s)) < 0)
+        goto fail;
+
+    if (!(seg->variants = av_mallocz(seg->nb_variants * sizeof(*seg->variants)))) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    for (i = 0; i < seg->nb_variants; i++) {
+        SegmentVariant *v = &seg->variants[i];
+        v->parent = s;
+        v->seg    = seg;
+        v->index  = i;
+    }
+    for (i = 0; i < seg->nb_variants; i++)
+        if ((ret = variant_init(&seg->variants[i])) < 0)
+            goto fail;
+
+    return 0;
+
+fail:
+    seg_free(s);
+    return ret;
+}
+
+static int seg_write_packet(AVFormatContext *s, AVPacket *pkt)
+{
+    SegmentContext *seg = s->priv_data;
+    SegmentVariant *v = &seg->variants[seg->stream_variant[pkt->stream_index]];
+    AVPacket vpkt = *pkt;
+
+    vpkt.stream_index = seg->stream_index[pkt->stream_index];
+
+#if HAVE_PTHREADS
+    if (v->mux_thread_started)
+        return variant_queue_packet(v, pkt, vpkt.stream_index);
+#endif
+
+    return variant_write_packet(v, &vpkt);
+}
+
+static int seg_write_trailer(struct AVFormatContext *s)
+{
+    SegmentContext *seg = s->priv_data;
+    int ret = 0, err, close_err, i;
+
+    for (i = 0; i < seg->nb_variants; i++) {
+        SegmentVariant *v = &seg->variants[i];
+
+        err = variant_mux_uninit(v);
+        if (!err && v->split_pending)
+            err = variant_split_complete(v);
+        if (!err)
+            err = segment_end(v);
+        close_err = segment_async_uninit(v);
+        if (!err)
+            err = close_err;
+        if (!err)
+            err = segment_publish_closed(v);
+        if (!err && seg->list)
+            err = segment_list_close(v);
+        if (!ret)
+            ret = err;
+    }
+
+    seg_free(s);
+    return ret;
+}
+
+#define OFFSET(x) offsetof(SegmentContext, x)
+#define E AV_OPT_FLAG_ENCODING_PARAM
+static const AVOption options[] = {
+    { "segment_format",    "container format used for the segments",  OFFSET(format),  AV_OPT_TYPE_STRING, {.str = NULL},  0, 0,       E },
+    { "segment_time",      "segment length in seconds",               OFFSET(time),    AV_OPT_TYPE_FLOAT,  {.dbl = 2},     0, FLT_MAX, E },
+    { "segment_size",      "start a new segment at the next keyframe once the current one reaches this size in bytes", OFFSET(max_size), AV_OPT_TYPE_INT64, {.dbl = 0}, 0, INT64_MAX, E },
+    { "segment_list",      "output the segment list",                 OFFSET(list),    AV_OPT_TYPE_STRING, {.str = NULL},  0, 0,       E },
+    { "segment_journal",   "record the progress in this file after every segment", OFFSET(journal), AV_OPT_TYPE_STRING, {.str = NULL}, 0, 0, E },
+    { "segment_resume",    "resume from the state recorded in the journal", OFFSET(resume), AV_OPT_TYPE_INT, {.dbl = 0}, 0, 1, E },
+    { "segment_list_type", "segment list format",                     OFFSET(list_type), AV_OPT_TYPE_INT, {.dbl = LIST_TYPE_UNDEFINED}, -1, LIST_TYPE_JSON, E, "list_type" },
+    { "flat", "one filename per line",                                0, AV_OPT_TYPE_CONST, {.dbl = LIST_TYPE_FLAT}, 0, 0, E, "list_type" },
+    { "csv",  "filename, index, start and end time, frame range and size", 0, AV_OPT_TYPE_CONST, {.dbl = LIST_TYPE_CSV}, 0, 0, E, "list_type" },
+    { "m3u8", "HLS playlist",                                         0, AV_OPT_TYPE_CONST, {.dbl = LIST_TYPE_M3U8}, 0, 0, E, "list_type" },
+    { "json", "array of segment descriptions",                        0, AV_OPT_TYPE_CONST, {.dbl = LIST_TYPE_JSON}, 0, 0, E, "list_type" },
+    { "segment_list_size", "maximum number of playlist entries, 0 for no limit, 5 for flat lists and no limit for the other formats if unset", OFFSET(size), AV_OPT_TYPE_INT, {.dbl = -1}, -1, INT_MAX, E },
+    { "segment_wrap",      "number after which the index wraps",      OFFSET(wrap),    AV_OPT_TYPE_INT,    {.dbl = 0},     0, INT_MAX, E },
+    { "segment_valid_frames",     "set valid segment split frames",        OFFSET(valid_frames.str), AV_OPT_TYPE_STRING, {.str = NULL}, 0, 0,      E },
+    { "segment_valid_frames_file", "read valid segment split frames from a file", OFFSET(valid_frames.file), AV_OPT_TYPE_STRING, {.str = NULL}, 0, 0, E },
+    { "segment_valid_pts",        "set valid segment split timestamps",    OFFSET(valid_pts.str), AV_OPT_TYPE_STRING, {.str = NULL}, 0, 0, E },
+    { "segment_valid_pts_file",   "read valid segment split timestamps from a file", OFFSET(valid_pts.file), AV_OPT_TYPE_STRING, {.str = NULL}, 0, 0, E },
+    { "segment_valid_pts_time_base", "time base of the valid split timestamps, the reference stream time base if unset", OFFSET(valid_pts_tb), AV_OPT_TYPE_RATIONAL, {.dbl = 0}, 0, INT_MAX, E },
+    { "segment_valid_pos",        "set valid segment split input byte positions", OFFSET(valid_pos.str), AV_OPT_TYPE_STRING, {.str = NULL}, 0, 0, E },
+    { "segment_valid_pos_file",   "read valid segment split input byte positions from a file", OFFSET(valid_pos.file), AV_OPT_TYPE_STRING, {.str = NULL}, 0, 0, E },
+    { "segment_ref_stream",       "stream whose keyframes start new segments, the first video stream of each variant if unset", OFFSET(ref_stream), AV_OPT_TYPE_INT, {.dbl = -1}, -1, INT_MAX, E },
+    { "segment_stream_valid_frames", "valid segment split frames of individual streams, as index:frames items separated by '|'", OFFSET(stream_valid_frames_str), AV_OPT_TYPE_STRING, {.str = NULL}, 0, 0, E },
+    { "segment_async_close",      "close finished segments in a background thread", OFFSET(async_close), AV_OPT_TYPE_INT, {.dbl = 0}, 0, 1, E },
+    { "segment_preopen",          "number of segments to open ahead of time", OFFSET(preopen), AV_OPT_TYPE_INT, {.dbl = 0}, 0, 64, E },
+    { "segment_async_queue_size", "maximum number of segments waiting to be closed", OFFSET(async_queue_size), AV_OPT_TYPE_INT, {.dbl = 4}, 1, INT_MAX / sizeof(AVIOContext *), E },
+    { "segment_variants",         "groups of stream indexes segmented into separate files", OFFSET(variants_str), AV_OPT_TYPE_STRING, {.str = NULL}, 0, 0, E },
+    { "segment_variant_threads",  "write every variant in its own thread", OFFSET(variant_threads), AV_OPT_TYPE_INT, {.dbl = 0}, 0, 1, E },
+    { "segment_variant_queue_size", "maximum number of packets waiting to be written by a variant thread", OFFSET(variant_queue_size), AV_OPT_TYPE_INT, {.dbl = 64}, 1, INT_MAX / sizeof(AVPacket), E },
+    { NULL },
+};
+
+static const AVClass seg_class = {
+    .class_name = "segment muxer",
+    .item_name  = av_default_item_name,
+    .option     = options,
+    .version    = LIBAVUTIL_VERSION_INT,
+};
+
+AVOutputFormat ff_segment_muxer = {
+    .name           = "segment",
+    .long_name      = NULL_IF_CONFIG_SMALL("segment muxer"),
+    .priv_data_size = sizeof(SegmentContext),
+    .flags          = AVFMT_GLOBALHEADER | AVFMT_NOFILE,
+    .write_header   = seg_write_header,
+    .write_packet   = seg_write_packet,
+    .write_trailer  = seg_write_trailer,
+    .priv_class     = &seg_class,
+};
+
+static const AVClass sseg_class = {
+    .class_name = "stream_segment muxer",
+    .item_name  = av_default_item_name,
+    .option     = options,
+    .version    = LIBAVUTIL_VERSION_INT,
+};
+
+AVOutputFormat ff_stream_segment_muxer = {
+    .name           = "stream_segment,ssegment",
+    .long_name      = NULL_IF_CONFIG_SMALL("streaming segment muxer"),
+    .priv_data_size = sizeof(SegmentContext),
+    .flags          = AVFMT_NOFILE,
+    .write_header   = seg_write_header,
+    .write_packet   = seg_write_packet,
+    .write_trailer  = seg_write_trailer,
+    .priv_class     = &sseg_class,
+};
+
+int av_segment_set_callback(AVFormatContext *s, AVSegmentCallback cb,
+                            void *opaque, int flags)
+{
+    SegmentContext *seg = s->priv_data;
+
+    if ((s->oformat != &ff_segment_muxer &&
+         s->oformat != &ff_stream_segment_muxer) || !seg)
+        return AVERROR(EINVAL);
+    if ((flags & AV_SEGMENT_FLAG_MEMORY) && !cb)
+        return AVERROR(EINVAL);
+
+    seg->callback        = cb;
+    seg->callback_opaque = opaque;
+    seg->callback_flags  = flags;
+
+    return 0;
+}
+
+int av_segment_is_split_point(AVFormatContext *s, int stream_index,
+                              int64_t frame, int64_t pts, int64_t splits,
+                              AVRational time_base)
+{
+    SegmentContext *seg = s->priv_data;
+    SegmentVariant *v;
+    SegmentStream *vs;
+    int64_t cursor = 0, time_splits;
+    int index;
+
+    if ((s->oformat != &ff_segment_muxer &&
+         s->oformat != &ff_stream_segment_muxer) || !seg ||
+        stream_index < 0 || stream_index >= s->nb_streams)
+        return AVERROR(EINVAL);
+    if (!seg->variants)
+        return 0;
+
+    v     = &seg->variants[seg->stream_variant[stream_index]];
+    index = seg->stream_index[stream_index];
+    vs    = &v->streams[index];
+
+    /* count the frames the same way as the muxer */
+    frame += vs->first_frame;
+
+    /* the first frame always belongs to the first segment */
+    if (!frame)
+        return 0;
+
+    if (vs->valid_frames &&
+        !match_split_point(vs->valid_frames, vs->nb_valid_frames, &cursor, frame))
+        return 0;
+    if (index != v->ref_stream)
+        return !!vs->valid_frames;
+
+    /* the split points below cannot be known before muxing */
+    if (seg->valid_pos.points)
+        return 0;
+
+    /* every split point of the reference stream reported so far is a time
+     * split, the muxer has started as many periods after them */
+    time_splits = v->first_time_splits + splits;
+    if (pts == AV_NOPTS_VALUE ||
+        av_compare_ts(pts, time_base, seg->recording_time * time_splits,
+                      AV_TIME_BASE_Q) < 0)
+        return 0;
+
+    cursor = 0;
+    if (seg->valid_frames.points &&
+        !match_split_point(seg->valid_frames.points, seg->valid_frames.nb_points,
+                           &cursor, frame))
+        return 0;
+
+    if (seg->valid_pts.points) {
+        AVRational tb = seg->valid_pts_tb.num ? seg->valid_pts_tb :
+                                                s->streams[stream_index]->time_base;
+        cursor = 0;
+        if (!match_split_point(seg->valid_pts.points, seg->valid_pts.nb_points,
+                               &cursor, av_rescale_q(pts, time_base, tb)))
+            return 0;
+    }
+
+    return 1;
+}
+
+int av_segment_get_resume_point(AVFormatContext *s, int64_t *pts, int64_t *pos)
+{
+    SegmentContext *seg = s->priv_data;
+    int i, found = 0;
+
+    if ((s->oformat != &ff_segment_muxer &&
+         s->oformat != &ff_stream_segment_muxer) || !seg)
+        return AVERROR(EINVAL);
+
+    *pts = AV_NOPTS_VALUE;
+    *pos = -1;
+    for (i = 0; i < seg->nb_variants; i++) {
+        SegmentVariant *v = &seg->variants[i];
+
+        if (!v->resuming)
+            continue;
+        if (!found || v->resume_pts == AV_NOPTS_VALUE ||
+            (*pts != AV_NOPTS_VALUE && v->resume_pts < *pts))
+            *pts = v->resume_pts;
+        if (!found || v->resume_pos < 0 || (*pos >= 0 && v->resume_pos < *pos))
+            *pos = v->resume_pos;
+        found = 1;
+    }
+
+    return found;
+}
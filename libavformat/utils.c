@@ -3661,6 +3661,26 @@ fail:
     return ret;
 }
 
+#if !CONFIG_SEGMENT_MUXER
+int av_segment_set_callback(AVFormatContext *s, AVSegmentCallback cb,
+                            void *opaque, int flags)
+{
+    return AVERROR(ENOSYS);
+}
+
+int av_segment_is_split_point(AVFormatContext *s, int stream_index,
+                              int64_t frame, int64_t pts, int64_t splits,
+                              AVRational time_base)
+{
+    return AVERROR(ENOSYS);
+}
+
+int av_segment_get_resume_point(AVFormatContext *s, int64_t *pts, int64_t *pos)
+{
+    return AVERROR(ENOSYS);
+}
+#endif
+
 int av_get_output_timestamp(struct AVFormatContext *s, int stream,
                             int64_t *dts, int64_t *wall)
 {
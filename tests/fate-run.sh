@@ -111,6 +111,28 @@ enc_dec_pcm(){
     ffmpeg -flags +bitexact -i ${encfile} -c:a pcm_${pcm_fmt} -f ${dec_fmt} -
 }
 
+# run the segment muxer with framecrc segments and a list of type $1, then
+# print the list and every segment
+segment(){
+    list=$1
+    shift
+    segfile="${outdir}/${test}-"
+    listfile="${outdir}/${test}.${list}"
+    cleanfiles=$listfile
+    tsegfile=$(target_path $segfile)
+    ffmpeg "$@" -segment_format framecrc -segment_list $(target_path $listfile) \
+        -y ${tsegfile}%d.crc || return
+    sed -e "s#${tsegfile}##" -e 's/, "write_time": [0-9.]*//' \
+        -e 's/,[0-9]*\.[0-9]*$//' $listfile
+    i=0
+    while test -f ${segfile}$i.crc; do
+        echo "#segment $i"
+        cat ${segfile}$i.crc
+        cleanfiles="$cleanfiles ${segfile}$i.crc"
+        i=$(($i + 1))
+    done
+}
+
 FLAGS="-flags +bitexact -sws_flags +accurate_rnd+bitexact"
 DEC_OPTS="-threads $threads -idct simple $FLAGS"
 ENC_OPTS="-threads 1        -idct simple -dct fastint"
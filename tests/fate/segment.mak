@@ -0,0 +1,38 @@
+SEGMENT_SRC = -f lavfi -i testsrc=s=64x48:r=10:d=4 -map 0
+SEGMENT_ENC = -threads 1 -vcodec mpeg4 -dct fastint -flags +bitexact
+
+FATE_SEGMENT += fate-segment-list-m3u8
+fate-segment-list-m3u8: CMD = segment m3u8 $(SEGMENT_SRC) $(SEGMENT_ENC) -g 5 \
+  -f segment -segment_time 1
+
+FATE_SEGMENT += fate-segment-list-csv
+fate-segment-list-csv: CMD = segment csv $(SEGMENT_SRC) $(SEGMENT_ENC) -g 5 \
+  -f segment -segment_time 1
+
+FATE_SEGMENT += fate-segment-list-json
+fate-segment-list-json: CMD = segment json $(SEGMENT_SRC) $(SEGMENT_ENC) -g 5 \
+  -f segment -segment_time 1
+
+FATE_SEGMENT += fate-segment-valid-frames
+fate-segment-valid-frames: CMD = segment flat $(SEGMENT_SRC) $(SEGMENT_ENC) -g 5 \
+  -f segment -segment_time 0.5 -segment_valid_frames 10,15,30
+
+FATE_SEGMENT += fate-segment-valid-pts
+fate-segment-valid-pts: CMD = segment flat $(SEGMENT_SRC) $(SEGMENT_ENC) -g 5 \
+  -f segment -segment_time 0.5 -segment_valid_pts 5,25 -segment_valid_pts_time_base 1/10
+
+FATE_SEGMENT += fate-segment-size
+fate-segment-size: CMD = segment csv $(SEGMENT_SRC) $(SEGMENT_ENC) -g 5 \
+  -f segment -segment_time 100 -segment_size 600
+
+FATE_SEGMENT += fate-segment-stream-valid-frames
+fate-segment-stream-valid-frames: CMD = segment json $(SEGMENT_SRC) -map 0 $(SEGMENT_ENC) \
+  -g:0 5 -g:1 4 -f segment -segment_time 1 -segment_ref_stream 0 \
+  -segment_stream_valid_frames "1:0,12,20,32"
+
+FATE_SEGMENT += fate-segment-force_key_frames
+fate-segment-force_key_frames: CMD = segment csv $(SEGMENT_SRC) $(SEGMENT_ENC) -g 100 \
+  -force_key_frames segment -f ssegment -segment_time 1.5
+
+FATE_FFMPEG += $(FATE_SEGMENT)
+fate-segment: $(FATE_SEGMENT)